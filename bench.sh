@@ -0,0 +1,288 @@
+#!/bin/bash
+
+# Benchmark suite: builds a synthetic repository and times mygit commands on it.
+#
+# Usage: ./bench.sh <executable_path> [results.json] [baseline.json]
+#
+# The repository is generated from a fixed seed, so two runs with the same
+# settings time exactly the same work. Settings come from the environment:
+#
+#   BENCH_FILES     number of files (default 5000)
+#   BENCH_DEPTH     directory depth (default 3)
+#   BENCH_FANOUT    subdirectories per directory (default 4)
+#   BENCH_MIN_SIZE  smallest file in bytes (default 64)
+#   BENCH_MAX_SIZE  largest file in bytes (default 65536), sizes are log-uniform
+#   BENCH_COMMITS   length of the generated history (default 20)
+#   BENCH_CHURN     files changed by each commit of the history (default 50)
+#   BENCH_SEED      seed of the generator (default 1)
+#   BENCH_WARMUP    untimed runs before each measurement (default 1)
+#   BENCH_RUNS      timed runs of each measurement (default 5)
+#   BENCH_TOLERANCE allowed slowdown against the baseline in percent (default 15)
+#   BENCH_DIR       where the repository is generated (default a temporary directory)
+#
+# Before timing anything, a scratch repository checks that a commit keeps an
+# empty file. The results are written as JSON. If a baseline file is given and exists,
+# the medians are compared with it and the script fails when one of them is
+# slower by more than BENCH_TOLERANCE percent.
+
+if [ -z "$1" ]; then
+    echo "Usage: $0 <executable_path> [results.json] [baseline.json]"
+    exit 1
+fi
+
+MYGIT="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+RESULTS="${2:-bench-results.json}"
+BASELINE="$3"
+
+FILES=${BENCH_FILES:-5000}
+DEPTH=${BENCH_DEPTH:-3}
+FANOUT=${BENCH_FANOUT:-4}
+MIN_SIZE=${BENCH_MIN_SIZE:-64}
+MAX_SIZE=${BENCH_MAX_SIZE:-65536}
+COMMITS=${BENCH_COMMITS:-20}
+CHURN=${BENCH_CHURN:-50}
+SEED=${BENCH_SEED:-1}
+WARMUP=${BENCH_WARMUP:-1}
+RUNS=${BENCH_RUNS:-5}
+TOLERANCE=${BENCH_TOLERANCE:-15}
+
+if [ -n "$BENCH_DIR" ]; then
+    REPO="$BENCH_DIR"
+    rm -rf "$REPO"
+    mkdir -p "$REPO"
+else
+    REPO=$(mktemp -d)
+    trap 'rm -rf "$REPO"' EXIT
+fi
+SCRATCH="$REPO.init"
+RESULTS="$(cd "$(dirname "$RESULTS")" && pwd)/$(basename "$RESULTS")"
+[ -n "$BASELINE" ] && BASELINE="$(cd "$(dirname "$BASELINE")" && pwd)/$(basename "$BASELINE")"
+
+# microseconds since the epoch, without forking when bash has EPOCHREALTIME
+now_us()
+{
+    if [ -n "$EPOCHREALTIME" ]; then
+        local t=${EPOCHREALTIME/[.,]/}
+        echo $((10#$t))
+    else
+        echo $(($(date +%s%N) / 1000))
+    fi
+}
+
+# writes (or rewrites, for round > 0) the files of the synthetic tree;
+# round 0 creates every file, a later round rewrites CHURN of them
+generate()
+{
+    awk -v files="$FILES" -v depth="$DEPTH" -v fanout="$FANOUT" \
+        -v min="$MIN_SIZE" -v max="$MAX_SIZE" -v churn="$CHURN" \
+        -v seed="$SEED" -v round="$1" '
+    function path_of(i,    p, d, n)
+    {
+        p = ""
+        n = int(i / 7)
+        for (d = 0; d < depth; d++)
+        {
+            p = p "d" (n % fanout) "/"
+            n = int(n / fanout)
+        }
+        return p "f" i ".txt"
+    }
+    function write_file(i,    p, size, line, n)
+    {
+        p = path_of(i)
+        size = int(exp(log(min) + rand() * (log(max) - log(min))))
+        line = sprintf("%d %d %.17f ", i, round, rand())
+        while (length(line) < 64)
+            line = line line
+        n = 0
+        printf "" > p
+        while (n < size)
+        {
+            print substr(line, 1, 63) >> p
+            n += 64
+        }
+        close(p)
+    }
+    BEGIN {
+        srand(seed + round)
+        if (round == 0)
+        {
+            for (i = 0; i < files; i++)
+            {
+                dir = path_of(i)
+                sub(/[^\/]*$/, "", dir)
+                if (!(dir in made))
+                {
+                    made[dir] = 1
+                    system("mkdir -p " dir)
+                }
+                write_file(i)
+            }
+        }
+        else
+        {
+            for (k = 0; k < churn; k++)
+                write_file(int(rand() * files))
+        }
+    }'
+}
+
+# runs "$@" WARMUP times untimed, then RUNS times timed, and records the
+# runtimes in milliseconds under the name $1; a function named setup_$1,
+# if there is one, runs before every run without being timed. a run that
+# fails stops the script, its time would say nothing
+measure()
+{
+    local name=$1
+    shift
+    local i start end status times=""
+    for ((i = 0; i < WARMUP + RUNS; i++)); do
+        if declare -f "setup_$name" > /dev/null; then
+            "setup_$name"
+        fi
+        start=$(now_us)
+        "$@" > /dev/null 2> "$REPO.stderr"
+        status=$?
+        end=$(now_us)
+        if ((status != 0)); then
+            echo "$name failed (exit status $status): $*"
+            cat "$REPO.stderr"
+            rm -rf "$REPO.stderr" "$SCRATCH"
+            exit 1
+        fi
+        if ((i >= WARMUP)); then
+            times="$times $((end - start))"
+        fi
+    done
+    rm -f "$REPO.stderr"
+    local sorted median min
+    sorted=$(echo $times | tr ' ' '\n' | sort -n)
+    min=$(echo "$sorted" | head -1)
+    median=$(echo "$sorted" | sed -n "$(((RUNS + 1) / 2))p")
+    printf '%-12s median %8.2f ms   min %8.2f ms\n' "$name" \
+        "$(echo "$median" | awk '{ print $1 / 1000 }')" "$(echo "$min" | awk '{ print $1 / 1000 }')"
+    local runs
+    runs=$(echo $times | awk '{ for (i = 1; i <= NF; i++) printf "%s%.3f", (i > 1 ? ", " : ""), $i / 1000 }')
+    RESULT_LINES+=("$(printf '    "%s": {"median_ms": %.3f, "min_ms": %.3f, "runs_ms": [%s]}' \
+        "$name" "$(echo "$median" | awk '{ print $1 / 1000 }')" "$(echo "$min" | awk '{ print $1 / 1000 }')" "$runs")")
+}
+
+cat_file_sample()
+{
+    local sha
+    for sha in $SAMPLE; do
+        "$MYGIT" cat-file -p "$sha" || return 1
+    done
+}
+
+setup_init() { rm -rf "$SCRATCH"; mkdir -p "$SCRATCH"; cd "$SCRATCH"; }
+setup_add() { cd "$REPO"; rm -f .mygit/index; }
+setup_add_noop() { cd "$REPO"; }
+setup_commit() { cd "$REPO"; echo "$RANDOM" >> "$(echo "$SAMPLE_PATHS" | head -1)"; "$MYGIT" add . > /dev/null; }
+setup_checkout()
+{
+    cd "$REPO"
+    if [ "$CHECKOUT_TARGET" = "$FIRST_COMMIT" ]; then
+        CHECKOUT_TARGET=$LAST_COMMIT
+    else
+        CHECKOUT_TARGET=$FIRST_COMMIT
+    fi
+}
+checkout_next() { "$MYGIT" checkout "$CHECKOUT_TARGET"; }
+
+# commits an empty file (next to another one, so the tree comes from the index)
+# in a scratch repository and looks for it in the tree
+check_empty_file()
+{
+    local dir="$REPO.check"
+    rm -rf "$dir"
+    mkdir -p "$dir" || return 1
+    (
+        cd "$dir" && "$MYGIT" init > /dev/null && touch empty && echo other > other &&
+            "$MYGIT" add empty other > /dev/null && "$MYGIT" commit -m "empty file" > /dev/null || exit 1
+        tree=$("$MYGIT" cat-file -p "$(cat .mygit/HEAD)" | awk '$1 == "tree" { print $2; exit }')
+        "$MYGIT" ls-tree "$tree" | grep -q " e69de29bb2d1d6434b8b29ae775ad8c2e48c5391 empty$"
+    )
+    local status=$?
+    rm -rf "$dir"
+    return $status
+}
+
+if ! check_empty_file; then
+    echo "Sanity check failed: the commit of an empty file does not contain it."
+    exit 1
+fi
+
+echo "Generating $FILES files (depth $DEPTH, $MIN_SIZE-$MAX_SIZE bytes) with $COMMITS commits in $REPO"
+cd "$REPO" || exit 1
+"$MYGIT" init > /dev/null
+generate 0
+"$MYGIT" add . > /dev/null
+FIRST_COMMIT=$("$MYGIT" commit -m "round 0" | awk '{ print $NF }')
+for ((round = 1; round < COMMITS; round++)); do
+    generate "$round"
+    "$MYGIT" add . > /dev/null
+    "$MYGIT" commit -m "round $round" > /dev/null
+done
+LAST_COMMIT=$(cat .mygit/HEAD)
+TREE=$("$MYGIT" cat-file -p "$LAST_COMMIT" | awk '$1 == "tree" { print $2; exit }')
+SAMPLE_PATHS=$(find . -path ./.mygit -prune -o -type f -print | sort | awk 'NR % 50 == 1' | head -100)
+SAMPLE=$(for p in $SAMPLE_PATHS; do "$MYGIT" hash-object "$p" | sed "s/^SHA-1://"; done)
+if [ -z "$FIRST_COMMIT" ] || [ -z "$TREE" ]; then
+    echo "Failed to generate the repository."
+    exit 1
+fi
+
+RESULT_LINES=()
+measure init "$MYGIT" init
+measure add "$MYGIT" add .
+measure add_noop "$MYGIT" add .
+measure commit "$MYGIT" commit -m "bench"
+measure log "$MYGIT" log
+measure cat-file cat_file_sample
+measure ls-tree "$MYGIT" ls-tree "$TREE"
+CHECKOUT_TARGET=$LAST_COMMIT
+measure checkout checkout_next
+cd "$REPO" && "$MYGIT" checkout "$LAST_COMMIT" > /dev/null
+rm -rf "$SCRATCH"
+
+{
+    echo "{"
+    printf '  "config": {"files": %d, "depth": %d, "fanout": %d, "min_size": %d, "max_size": %d, "commits": %d, "churn": %d, "seed": %d, "warmup": %d, "runs": %d},\n' \
+        "$FILES" "$DEPTH" "$FANOUT" "$MIN_SIZE" "$MAX_SIZE" "$COMMITS" "$CHURN" "$SEED" "$WARMUP" "$RUNS"
+    echo '  "results": {'
+    for ((i = 0; i < ${#RESULT_LINES[@]}; i++)); do
+        if ((i + 1 < ${#RESULT_LINES[@]})); then
+            echo "${RESULT_LINES[$i]},"
+        else
+            echo "${RESULT_LINES[$i]}"
+        fi
+    done
+    echo "  }"
+    echo "}"
+} > "$RESULTS"
+echo "Results written to $RESULTS"
+
+if [ -z "$BASELINE" ] || [ ! -f "$BASELINE" ]; then
+    exit 0
+fi
+
+# every result is on a line of its own, so the medians can be read back with awk
+medians()
+{
+    awk -F'"' '/"median_ms"/ { split($5, v, /[ ,]+/); print $2, v[2] }' "$1"
+}
+
+if ! cmp -s <(grep '"config"' "$BASELINE") <(grep '"config"' "$RESULTS"); then
+    echo "Warning: the baseline was made with different settings."
+fi
+echo "Comparing with $BASELINE"
+join <(medians "$BASELINE" | sort) <(medians "$RESULTS" | sort) | awk -v tolerance="$TOLERANCE" '
+{
+    change = $2 > 0 ? ($3 - $2) * 100 / $2 : 0
+    flag = change > tolerance ? "  REGRESSION" : ""
+    printf "%-12s %8.2f ms -> %8.2f ms  %+6.1f%%%s\n", $1, $2, $3, change, flag
+    if (flag != "")
+        failed = 1
+}
+END { exit failed }'
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <iomanip>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <sys/stat.h>
 #include <cstring>
 #include <vector>
@@ -12,11 +13,461 @@
 #include <unistd.h>
 #include <filesystem>
 #include <cstdlib>
+#include <map>
+#include <set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <exception>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <ctime>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <csignal>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 string write_tree(const string &path);
 
+bool starts_with(const string &str, const string &prefix)
+{
+    return str.size() >= prefix.size() && str.compare(0, prefix.size(), prefix) == 0;
+}
+
+// number of threads used by write-tree / commit (set with -j or core.jobs)
+unsigned num_jobs = 0;
+
+// to read settings from .mygit/config, either "key = value" lines or git-style
+// "[section]" blocks which turn "jobs = 4" into "core.jobs"
+map<string, string> load_config()
+{
+    map<string, string> config;
+    ifstream ifs(".mygit/config");
+    string line, section;
+    while (getline(ifs, line))
+    {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#' || line[start] == ';')
+            continue;
+        line = line.substr(start);
+        if (line[0] == '[')
+        {
+            size_t end = line.find(']');
+            section = line.substr(1, end == string::npos ? string::npos : end - 1);
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (eq == string::npos)
+            continue;
+        string key = line.substr(0, eq);
+        string value = line.substr(eq + 1);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        size_t value_start = value.find_first_not_of(" \t");
+        value = (value_start == string::npos) ? "" : value.substr(value_start);
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+        if (!section.empty())
+            key = section + "." + key;
+        config[key] = value;
+    }
+    return config;
+}
+
+string get_config(const string &key, const string &default_value = "")
+{
+    static const map<string, string> config = load_config();
+    auto it = config.find(key);
+    return it == config.end() ? default_value : it->second;
+}
+
+// work-stealing thread pool: every worker owns a deque, runs its own newest
+// task first and steals the oldest task of another worker when it runs dry
+class thread_pool
+{
+public:
+    explicit thread_pool(unsigned workers) : stopping(false), queued(0), next_queue(0)
+    {
+        for (unsigned i = 0; i < workers; ++i)
+            queues.emplace_back(new work_queue);
+        for (unsigned i = 0; i < workers; ++i)
+            threads.emplace_back(&thread_pool::worker_loop, this, i);
+    }
+
+    ~thread_pool()
+    {
+        {
+            lock_guard<mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads)
+            t.join();
+    }
+
+    void submit(function<void()> task)
+    {
+        // workers push onto their own deque, other threads spread tasks round-robin
+        size_t q = (current_pool == this) ? current_worker : next_queue++ % queues.size();
+        {
+            lock_guard<mutex> lock(sleep_mutex);
+            ++queued;
+        }
+        {
+            lock_guard<mutex> lock(queues[q]->m);
+            queues[q]->tasks.push_back(move(task));
+        }
+        wake.notify_one();
+        progress.notify_all();
+    }
+
+    // to block a thread waiting on a task group until done() holds or a task
+    // is queued that it can help with, instead of spinning on run_one
+    void wait_for_progress(const function<bool()> &done)
+    {
+        unique_lock<mutex> lock(sleep_mutex);
+        progress.wait(lock, [&]() { return done() || queued > 0; });
+    }
+
+    // called when a task group has no tasks left; the lock makes sure a waiter
+    // that has just seen tasks outstanding is already asleep and gets woken
+    void notify_progress()
+    {
+        lock_guard<mutex> lock(sleep_mutex);
+        progress.notify_all();
+    }
+
+    // run one queued task on the calling thread, returns false if none was found
+    bool run_one()
+    {
+        function<void()> task;
+        size_t n = queues.size();
+        size_t self = (current_pool == this) ? current_worker : next_queue % n;
+
+        {
+            lock_guard<mutex> lock(queues[self]->m);
+            if (!queues[self]->tasks.empty())
+            {
+                task = move(queues[self]->tasks.back());
+                queues[self]->tasks.pop_back();
+            }
+        }
+        for (size_t i = 1; !task && i < n; ++i)
+        {
+            work_queue &victim = *queues[(self + i) % n];
+            lock_guard<mutex> lock(victim.m);
+            if (!victim.tasks.empty())
+            {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+            }
+        }
+        if (!task)
+            return false;
+
+        {
+            lock_guard<mutex> lock(sleep_mutex);
+            --queued;
+        }
+        task();
+        return true;
+    }
+
+private:
+    struct work_queue
+    {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+
+    void worker_loop(size_t index)
+    {
+        current_pool = this;
+        current_worker = index;
+        while (true)
+        {
+            if (run_one())
+                continue;
+            unique_lock<mutex> lock(sleep_mutex);
+            wake.wait(lock, [this]() { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+    vector<unique_ptr<work_queue>> queues;
+    vector<thread> threads;
+    mutex sleep_mutex;
+    condition_variable wake;
+    condition_variable progress;
+    bool stopping;
+    size_t queued;
+    atomic<size_t> next_queue;
+
+    static thread_local thread_pool *current_pool;
+    static thread_local size_t current_worker;
+};
+
+thread_local thread_pool *thread_pool::current_pool = nullptr;
+thread_local size_t thread_pool::current_worker = 0;
+
+// to get the shared pool, nullptr when running with a single job
+thread_pool *get_pool()
+{
+    static unique_ptr<thread_pool> pool;
+    static once_flag created;
+    call_once(created, []()
+    {
+        unsigned jobs = num_jobs;
+        if (jobs == 0)
+            jobs = atoi(get_config("core.jobs", "0").c_str());
+        if (jobs == 0)
+            jobs = max(1u, thread::hardware_concurrency());
+        // the calling thread also runs tasks while it waits, so it counts as one job
+        if (jobs > 1)
+            pool.reset(new thread_pool(jobs - 1));
+    });
+    return pool.get();
+}
+
+// a set of tasks that can be waited on; the waiting thread helps run queued
+// tasks so nested groups (subdirectories) never deadlock the pool
+class task_group
+{
+public:
+    explicit task_group(thread_pool *pool) : pool(pool), outstanding(0) {}
+
+    void run(function<void()> task)
+    {
+        if (!pool)
+        {
+            guarded(task);
+            return;
+        }
+        ++outstanding;
+        thread_pool *p = pool;
+        pool->submit([this, p, task]()
+        {
+            guarded(task);
+            // the group may be gone as soon as outstanding reaches 0, only p is used after it
+            if (--outstanding == 0)
+                p->notify_progress();
+        });
+    }
+
+    void wait()
+    {
+        while (outstanding > 0)
+        {
+            if (!pool->run_one())
+                pool->wait_for_progress([this]() { return outstanding == 0; });
+        }
+        if (error)
+            rethrow_exception(error);
+    }
+
+private:
+    void guarded(const function<void()> &task)
+    {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            lock_guard<mutex> lock(error_mutex);
+            if (!error)
+                error = current_exception();
+        }
+    }
+
+    thread_pool *pool;
+    atomic<size_t> outstanding;
+    mutex error_mutex;
+    exception_ptr error;
+};
+
+// tracing: with MYGIT_TRACE set, the wall and CPU time spent in each phase and
+// a few counters are written as one JSON line when the command exits; the value
+// is a file to append to, or "1" for stderr. when it is not set every hook is a
+// single test of trace_on
+enum trace_phase
+{
+    phase_walk,
+    phase_hash,
+    phase_compress,
+    phase_object_write,
+    phase_inflate,
+    phase_file_read,
+    phase_file_write,
+    phase_count
+};
+
+const char *const trace_phase_names[phase_count] = {"walk", "hash", "compress", "object_write",
+                                                     "inflate", "file_read", "file_write"};
+
+enum trace_counter
+{
+    counter_stat,
+    counter_objects_read,
+    counter_objects_written,
+    counter_bytes_inflated,
+    counter_bytes_deflated,
+    counter_cache_hits,
+    counter_cache_misses,
+    counter_count
+};
+
+const char *const trace_counter_names[counter_count] = {"stat_calls", "objects_read", "objects_written",
+                                                         "bytes_inflated", "bytes_deflated", "cache_hits",
+                                                         "cache_misses"};
+
+bool trace_on = false;
+
+struct trace_totals
+{
+    atomic<uint64_t> calls[phase_count];
+    atomic<uint64_t> wall_ns[phase_count];
+    atomic<uint64_t> cpu_ns[phase_count];
+    atomic<uint64_t> counters[counter_count];
+    string target;
+    string command;
+    uint64_t start_ns;
+};
+
+trace_totals traced;
+
+uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline void trace_count(trace_counter counter, uint64_t n = 1)
+{
+    if (trace_on)
+        traced.counters[counter].fetch_add(n, memory_order_relaxed);
+}
+
+// to time the rest of the enclosing block as one call of a phase; phases run on
+// several threads at once are summed, so a phase can add up to more than the
+// wall time of the command, and a phase inside another (inflating a tree while
+// walking it) is counted in both
+class trace_scope
+{
+public:
+    explicit trace_scope(trace_phase phase) : phase(phase), active(trace_on)
+    {
+        if (active)
+        {
+            wall = clock_ns(CLOCK_MONOTONIC);
+            cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+        }
+    }
+
+    ~trace_scope()
+    {
+        if (!active)
+            return;
+        traced.calls[phase].fetch_add(1, memory_order_relaxed);
+        traced.wall_ns[phase].fetch_add(clock_ns(CLOCK_MONOTONIC) - wall, memory_order_relaxed);
+        traced.cpu_ns[phase].fetch_add(clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu, memory_order_relaxed);
+    }
+
+private:
+    trace_phase phase;
+    bool active;
+    uint64_t wall = 0;
+    uint64_t cpu = 0;
+};
+
+string json_escape(const string &s)
+{
+    string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += string("\\") + c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+            out += c;
+    }
+    return out;
+}
+
+// to write the trace of the finished command, with one write so traces of
+// commands running at the same time do not mix in the file
+void write_trace()
+{
+    ostringstream oss;
+    oss << fixed << setprecision(3);
+    oss << "{\"command\":\"" << json_escape(traced.command) << "\",\"pid\":" << getpid()
+        << ",\"wall_ms\":" << (clock_ns(CLOCK_MONOTONIC) - traced.start_ns) / 1e6
+        << ",\"cpu_ms\":" << clock_ns(CLOCK_PROCESS_CPUTIME_ID) / 1e6 << ",\"phases\":{";
+    bool first = true;
+    for (int i = 0; i < phase_count; ++i)
+    {
+        if (traced.calls[i] == 0)
+            continue;
+        oss << (first ? "" : ",") << "\"" << trace_phase_names[i] << "\":{\"calls\":" << traced.calls[i]
+            << ",\"wall_ms\":" << traced.wall_ns[i] / 1e6 << ",\"cpu_ms\":" << traced.cpu_ns[i] / 1e6 << "}";
+        first = false;
+    }
+    oss << "},\"counters\":{";
+    for (int i = 0; i < counter_count; ++i)
+        oss << (i ? "," : "") << "\"" << trace_counter_names[i] << "\":" << traced.counters[i];
+    oss << "}}\n";
+
+    string line = oss.str();
+    int fd = 2;
+    if (traced.target != "1" && traced.target != "2" && traced.target != "true")
+        fd = open(traced.target.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, line.data(), line.size()) != (ssize_t)line.size())
+        cerr << "Failed to write trace: " << traced.target << endl;
+    if (fd != 2)
+        close(fd);
+}
+
+// to turn tracing on from MYGIT_TRACE for the command in argv
+void start_trace(int argc, char *argv[])
+{
+    const char *target = getenv("MYGIT_TRACE");
+    if (!target || !*target || string(target) == "0" || string(target) == "false")
+        return;
+    traced.target = target;
+    for (int i = 1; i < argc; ++i)
+        traced.command += (i > 1 ? " " : "") + string(argv[i]);
+    traced.start_ns = clock_ns(CLOCK_MONOTONIC);
+    trace_on = true;
+    atexit(write_trace);
+}
+
 // to store directory entries
 struct tree_entry
 {
@@ -25,406 +476,6515 @@ struct tree_entry
     // SHA-1 value of the file/directory content
     string sha;
     string filename;
+    // "100644", "100755" (executable) or "40000" (directory)
+    string mode;
+};
+
+string read_file(const string &filename)
+{
+    trace_scope scope(phase_file_read);
+    ifstream ifs(filename, ios::binary);
+    if (!ifs)
+    {
+        cerr << "Failed to open file: " << filename << endl;
+        return "";
+    }
+    ostringstream oss;
+    oss << ifs.rdbuf();
+    return oss.str();
+}
+
+void put_be32(string &out, uint32_t v)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>((v >> shift) & 0xff));
+}
+
+void put_be64(string &out, uint64_t v)
+{
+    put_be32(out, static_cast<uint32_t>(v >> 32));
+    put_be32(out, static_cast<uint32_t>(v));
+}
+
+uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+uint64_t get_be64(const unsigned char *p)
+{
+    return (uint64_t(get_be32(p)) << 32) | get_be32(p + 4);
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// value of one hex digit, 0 for anything else
+inline unsigned char hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 0;
+}
+
+string hex_to_bin(const string &hex_sha)
+{
+    string bin(hex_sha.size() / 2, '\0');
+    for (size_t i = 0; i < bin.size(); ++i)
+        bin[i] = static_cast<char>((hex_value(hex_sha[2 * i]) << 4) | hex_value(hex_sha[2 * i + 1]));
+    return bin;
+}
+
+string bin_to_hex(const unsigned char *bin, size_t len)
+{
+    string out(len * 2, '\0');
+    for (size_t i = 0; i < len; ++i)
+    {
+        out[2 * i] = hex_digits[bin[i] >> 4];
+        out[2 * i + 1] = hex_digits[bin[i] & 0xf];
+    }
+    return out;
+}
+
+// SHA-1 engine: on CPUs with the SHA extensions the compression function runs
+// on SHA-NI, otherwise OpenSSL does the work; sha1_many hashes batches of small
+// messages, eight at a time with AVX2 when SHA-NI is not there
+struct cpu_features
+{
+    bool sha_ni = false;
+    bool avx2 = false;
+};
+
+const cpu_features &get_cpu_features()
+{
+    static const cpu_features features = []()
+    {
+        cpu_features f;
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned a, b, c, d;
+        if (!__get_cpuid(1, &a, &b, &c, &d))
+            return f;
+        bool ssse3 = c & bit_SSSE3, sse41 = c & bit_SSE4_1;
+        bool ymm_enabled = false;
+        if ((c & bit_OSXSAVE) && (c & bit_AVX))
+        {
+            // the OS has to save the upper halves of the ymm registers
+            unsigned lo, hi;
+            __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            ymm_enabled = (lo & 6) == 6;
+        }
+        if (__get_cpuid_count(7, 0, &a, &b, &c, &d))
+        {
+            f.sha_ni = ssse3 && sse41 && (b & bit_SHA);
+            f.avx2 = ymm_enabled && (b & bit_AVX2);
+        }
+#endif
+        return f;
+    }();
+    return features;
+}
+
+const uint32_t sha1_initial_state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+// to build the last one or two blocks of a message: the remaining bytes, 0x80,
+// zeros and the length in bits; returns the number of blocks
+size_t sha1_padding(const unsigned char *rest, size_t rest_len, uint64_t total_len, unsigned char out[128])
+{
+    size_t blocks = rest_len < 56 ? 1 : 2;
+    memcpy(out, rest, rest_len);
+    out[rest_len] = 0x80;
+    memset(out + rest_len + 1, 0, blocks * 64 - rest_len - 1);
+    uint64_t bits = total_len * 8;
+    for (int i = 0; i < 8; ++i)
+        out[blocks * 64 - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    return blocks;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the SHA-NI version of the compression function: each step runs four rounds,
+// m0..m3 hold the next sixteen message words and are extended in place
+#define SHA1_NI_STEP(f, w)                                          \
+    do                                                              \
+    {                                                               \
+        e0 = _mm_sha1nexte_epu32(e0, w);                            \
+        e1 = abcd;                                                  \
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, f);                    \
+        e0 = e1;                                                    \
+    } while (0)
+#define SHA1_NI_NEXT(a, b, c, d) a = _mm_sha1msg2_epu32(_mm_xor_si128(_mm_sha1msg1_epu32(a, b), c), d)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha1_blocks_ni(uint32_t state[5], const unsigned char *data, size_t blocks)
+{
+    const __m128i shuffle = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1b);
+    __m128i e = _mm_set_epi32(state[4], 0, 0, 0);
+
+    for (; blocks > 0; --blocks, data += 64)
+    {
+        __m128i abcd_save = abcd;
+        __m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data)), shuffle);
+        __m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16)), shuffle);
+        __m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 32)), shuffle);
+        __m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 48)), shuffle);
+
+        // e0 carries E (plus the message words) into the next step, e1 the state before the last step
+        __m128i e0 = _mm_add_epi32(e, m0), e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        e0 = e1;
+        SHA1_NI_STEP(0, m1);
+        SHA1_NI_STEP(0, m2);
+        SHA1_NI_STEP(0, m3);
+        SHA1_NI_NEXT(m0, m1, m2, m3); SHA1_NI_STEP(0, m0);
+        SHA1_NI_NEXT(m1, m2, m3, m0); SHA1_NI_STEP(1, m1);
+        SHA1_NI_NEXT(m2, m3, m0, m1); SHA1_NI_STEP(1, m2);
+        SHA1_NI_NEXT(m3, m0, m1, m2); SHA1_NI_STEP(1, m3);
+        SHA1_NI_NEXT(m0, m1, m2, m3); SHA1_NI_STEP(1, m0);
+        SHA1_NI_NEXT(m1, m2, m3, m0); SHA1_NI_STEP(1, m1);
+        SHA1_NI_NEXT(m2, m3, m0, m1); SHA1_NI_STEP(2, m2);
+        SHA1_NI_NEXT(m3, m0, m1, m2); SHA1_NI_STEP(2, m3);
+        SHA1_NI_NEXT(m0, m1, m2, m3); SHA1_NI_STEP(2, m0);
+        SHA1_NI_NEXT(m1, m2, m3, m0); SHA1_NI_STEP(2, m1);
+        SHA1_NI_NEXT(m2, m3, m0, m1); SHA1_NI_STEP(2, m2);
+        SHA1_NI_NEXT(m3, m0, m1, m2); SHA1_NI_STEP(3, m3);
+        SHA1_NI_NEXT(m0, m1, m2, m3); SHA1_NI_STEP(3, m0);
+        SHA1_NI_NEXT(m1, m2, m3, m0); SHA1_NI_STEP(3, m1);
+        SHA1_NI_NEXT(m2, m3, m0, m1); SHA1_NI_STEP(3, m2);
+        SHA1_NI_NEXT(m3, m0, m1, m2); SHA1_NI_STEP(3, m3);
+
+        e = _mm_sha1nexte_epu32(e0, e);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e, 3);
+}
+#undef SHA1_NI_STEP
+#undef SHA1_NI_NEXT
+
+__attribute__((target("avx2")))
+inline __m256i rotl_x8(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+// eight independent messages one block each: lane i of every vector belongs to message i
+__attribute__((target("avx2")))
+void sha1_blocks_x8(uint32_t state[5][8], const uint32_t block[16][8])
+{
+    __m256i s[5], w[16];
+    for (int i = 0; i < 5; ++i)
+        s[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(state[i]));
+    for (int i = 0; i < 16; ++i)
+        w[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block[i]));
+
+    __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+    for (int t = 0; t < 80; ++t)
+    {
+        if (t >= 16)
+            w[t & 15] = rotl_x8(_mm256_xor_si256(_mm256_xor_si256(w[(t + 13) & 15], w[(t + 8) & 15]),
+                                              _mm256_xor_si256(w[(t + 2) & 15], w[t & 15])), 1);
+        __m256i f, k;
+        if (t < 20)
+        {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+            k = _mm256_set1_epi32(0x5a827999);
+        }
+        else if (t < 40)
+        {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(0x6ed9eba1);
+        }
+        else if (t < 60)
+        {
+            f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            k = _mm256_set1_epi32(0x8f1bbcdc);
+        }
+        else
+        {
+            f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            k = _mm256_set1_epi32(0xca62c1d6);
+        }
+        __m256i temp = _mm256_add_epi32(_mm256_add_epi32(rotl_x8(a, 5), f),
+                                        _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+        e = d;
+        d = c;
+        c = rotl_x8(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    s[0] = _mm256_add_epi32(s[0], a);
+    s[1] = _mm256_add_epi32(s[1], b);
+    s[2] = _mm256_add_epi32(s[2], c);
+    s[3] = _mm256_add_epi32(s[3], d);
+    s[4] = _mm256_add_epi32(s[4], e);
+    for (int i = 0; i < 5; ++i)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(state[i]), s[i]);
+}
+#endif
+
+// incremental SHA-1 over whichever engine the CPU supports
+class sha1
+{
+public:
+    explicit sha1(bool use_ni = get_cpu_features().sha_ni) : ctx(nullptr), block_len(0), length(0)
+    {
+        if (use_ni)
+            memcpy(state, sha1_initial_state, sizeof(state));
+        else
+        {
+            ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx, EVP_sha1(), nullptr);
+        }
+    }
+    ~sha1()
+    {
+        if (ctx)
+            EVP_MD_CTX_free(ctx);
+    }
+    sha1(const sha1 &) = delete;
+    sha1 &operator=(const sha1 &) = delete;
+
+    void update(const void *data, size_t len)
+    {
+        if (ctx)
+        {
+            EVP_DigestUpdate(ctx, data, len);
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        length += len;
+        if (block_len > 0)
+        {
+            size_t n = min(len, sizeof(block) - block_len);
+            memcpy(block + block_len, p, n);
+            block_len += n;
+            p += n;
+            len -= n;
+            if (block_len < sizeof(block))
+                return;
+            sha1_blocks_ni(state, block, 1);
+            block_len = 0;
+        }
+        if (len >= 64)
+        {
+            sha1_blocks_ni(state, p, len / 64);
+            p += len / 64 * 64;
+            len %= 64;
+        }
+        memcpy(block, p, len);
+        block_len = len;
+#endif
+    }
+
+    void update(const string &data) { update(data.data(), data.size()); }
+
+    void final(unsigned char out[SHA_DIGEST_LENGTH])
+    {
+        if (ctx)
+        {
+            EVP_DigestFinal_ex(ctx, out, nullptr);
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned char tail[128];
+        sha1_blocks_ni(state, tail, sha1_padding(block, block_len, length, tail));
+        for (int i = 0; i < 5; ++i)
+        {
+            out[4 * i] = static_cast<unsigned char>(state[i] >> 24);
+            out[4 * i + 1] = static_cast<unsigned char>(state[i] >> 16);
+            out[4 * i + 2] = static_cast<unsigned char>(state[i] >> 8);
+            out[4 * i + 3] = static_cast<unsigned char>(state[i]);
+        }
+#endif
+    }
+
+    string final_hex()
+    {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        final(hash);
+        return bin_to_hex(hash, SHA_DIGEST_LENGTH);
+    }
+
+private:
+    EVP_MD_CTX *ctx;
+    uint32_t state[5];
+    unsigned char block[64];
+    size_t block_len;
+    uint64_t length;
 };
 
-string read_file(const string &filename)
+// to hash a whole buffer in one call
+void sha1_buffer(const void *data, size_t len, unsigned char out[SHA_DIGEST_LENGTH])
+{
+    sha1 ctx;
+    ctx.update(data, len);
+    ctx.final(out);
+}
+
+typedef pair<const unsigned char *, size_t> sha1_message;
+
+#if defined(__x86_64__) || defined(__i386__)
+// multi-buffer hashing: every lane walks its own message block by block and
+// takes the next waiting message as soon as it is done
+void sha1_many_x8(const vector<sha1_message> &messages, unsigned char *out)
+{
+    struct lane
+    {
+        size_t message = SIZE_MAX;
+        size_t block = 0, full_blocks = 0, blocks = 0;
+        unsigned char tail[128];
+    } lanes[8];
+    alignas(32) uint32_t state[5][8];
+    alignas(32) uint32_t block[16][8];
+    size_t next = 0;
+
+    while (true)
+    {
+        bool busy = false;
+        for (int l = 0; l < 8; ++l)
+        {
+            lane &ln = lanes[l];
+            if (ln.message == SIZE_MAX && next < messages.size())
+            {
+                const sha1_message &m = messages[next];
+                ln.message = next++;
+                ln.block = 0;
+                ln.full_blocks = m.second / 64;
+                ln.blocks = ln.full_blocks + sha1_padding(m.first + ln.full_blocks * 64, m.second % 64, m.second, ln.tail);
+                for (int i = 0; i < 5; ++i)
+                    state[i][l] = sha1_initial_state[i];
+            }
+            if (ln.message == SIZE_MAX)
+            {
+                for (int i = 0; i < 16; ++i)
+                    block[i][l] = 0;
+                continue;
+            }
+            busy = true;
+            const unsigned char *p = ln.block < ln.full_blocks ? messages[ln.message].first + ln.block * 64
+                                                               : ln.tail + (ln.block - ln.full_blocks) * 64;
+            for (int i = 0; i < 16; ++i)
+                block[i][l] = get_be32(p + 4 * i);
+        }
+        if (!busy)
+            break;
+
+        sha1_blocks_x8(state, block);
+
+        for (int l = 0; l < 8; ++l)
+        {
+            lane &ln = lanes[l];
+            if (ln.message == SIZE_MAX || ++ln.block < ln.blocks)
+                continue;
+            unsigned char *digest = out + ln.message * SHA_DIGEST_LENGTH;
+            for (int i = 0; i < 5; ++i)
+            {
+                digest[4 * i] = static_cast<unsigned char>(state[i][l] >> 24);
+                digest[4 * i + 1] = static_cast<unsigned char>(state[i][l] >> 16);
+                digest[4 * i + 2] = static_cast<unsigned char>(state[i][l] >> 8);
+                digest[4 * i + 3] = static_cast<unsigned char>(state[i][l]);
+            }
+            ln.message = SIZE_MAX;
+        }
+    }
+}
+#endif
+
+// to hash a batch of independent messages, 20 bytes per message go to out
+void sha1_many(const vector<sha1_message> &messages, unsigned char *out)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    // one SHA-NI stream is faster than eight AVX2 lanes
+    if (!get_cpu_features().sha_ni && get_cpu_features().avx2 && messages.size() > 1)
+    {
+        sha1_many_x8(messages, out);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < messages.size(); ++i)
+        sha1_buffer(messages[i].first, messages[i].second, out + i * SHA_DIGEST_LENGTH);
+}
+
+// to turn "./dir/file" into "dir/file" so every command uses the same index key
+string normalize_path(const string &path)
+{
+    string p = path;
+    while (starts_with(p, "./"))
+        p = p.substr(2);
+    return p;
+}
+
+// packfiles live in .mygit/objects/pack as pack-<sha>.pack / pack-<sha>.idx
+//
+// .pack : "PACK", version, object count, then every object as
+//         type byte, varint inflated size, varint compressed size, zlib data
+//         (deltas add the distance back to their base, see pack_entry_at);
+//         followed by a SHA-1 of everything before it
+// .idx  : "\377tOc", version, 256-entry fanout table (number of objects whose
+//         first SHA byte is <= i), sorted binary SHA-1s, 64-bit pack offsets,
+//         pack checksum and a SHA-1 of the idx itself
+const uint32_t pack_version = 2;
+const unsigned char pack_obj_full = 1;
+const unsigned char pack_obj_ofs_delta = 2;
+const char idx_magic[4] = {'\377', 't', 'O', 'c'};
+
+struct pack_file
+{
+    string pack_path;
+    const unsigned char *idx = nullptr;
+    size_t idx_size = 0;
+    const unsigned char *pack = nullptr;
+    size_t pack_size = 0;
+    uint32_t count = 0;
+
+    const unsigned char *fanout() const { return idx + 8; }
+    const unsigned char *oids() const { return idx + 8 + 256 * 4; }
+    const unsigned char *offsets() const { return oids() + (size_t)count * SHA_DIGEST_LENGTH; }
+};
+
+const unsigned char *map_file(const string &path, size_t &size)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return nullptr;
+    size = st.st_size;
+    return static_cast<const unsigned char *>(p);
+}
+
+// to mmap the index and the pack of pack-<sha> (base is the path without the
+// extension), false with a message if they are missing or unusable
+bool open_pack(const string &base, pack_file &pack)
+{
+    pack.pack_path = base + ".pack";
+    pack.idx = map_file(base + ".idx", pack.idx_size);
+    if (!pack.idx)
+        return false;
+    if (pack.idx_size < 8 + 256 * 4 + 2 * SHA_DIGEST_LENGTH || memcmp(pack.idx, idx_magic, 4) != 0)
+    {
+        cerr << "Ignoring invalid pack index: " << base << ".idx" << endl;
+        munmap(const_cast<unsigned char *>(pack.idx), pack.idx_size);
+        return false;
+    }
+    pack.count = get_be32(pack.fanout() + 255 * 4);
+    if (pack.idx_size < 8 + 256 * 4 + (size_t)pack.count * (SHA_DIGEST_LENGTH + 8) + 2 * SHA_DIGEST_LENGTH)
+    {
+        cerr << "Ignoring truncated pack index: " << base << ".idx" << endl;
+        munmap(const_cast<unsigned char *>(pack.idx), pack.idx_size);
+        return false;
+    }
+    pack.pack = map_file(pack.pack_path, pack.pack_size);
+    if (!pack.pack)
+    {
+        cerr << "Missing packfile for index: " << base << ".idx" << endl;
+        munmap(const_cast<unsigned char *>(pack.idx), pack.idx_size);
+        return false;
+    }
+    if (pack.pack_size < 12 + SHA_DIGEST_LENGTH || memcmp(pack.pack, "PACK", 4) != 0 ||
+        get_be32(pack.pack + 4) == 0 || get_be32(pack.pack + 4) > pack_version)
+    {
+        cerr << "Ignoring unsupported packfile: " << pack.pack_path << endl;
+        munmap(const_cast<unsigned char *>(pack.idx), pack.idx_size);
+        munmap(const_cast<unsigned char *>(pack.pack), pack.pack_size);
+        return false;
+    }
+    return true;
+}
+
+// to mmap every pack index (and its pack) once per process
+vector<pack_file> load_packs()
+{
+    vector<pack_file> packs;
+    DIR *dir = opendir(".mygit/objects/pack");
+    if (!dir)
+        return packs;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        string name = entry->d_name;
+        if (!starts_with(name, "pack-") || name.size() < 4 || name.compare(name.size() - 4, 4, ".idx") != 0)
+            continue;
+
+        pack_file pack;
+        if (open_pack(".mygit/objects/pack/" + name.substr(0, name.size() - 4), pack))
+            packs.push_back(pack);
+    }
+    closedir(dir);
+    return packs;
+}
+
+vector<pack_file> &get_packs()
+{
+    static vector<pack_file> packs = load_packs();
+    return packs;
+}
+
+// to find an object in the pack indexes: the fanout table narrows the range to
+// the objects sharing the first byte, then a binary search finds the SHA
+bool find_packed_object(const string &sha, const pack_file *&found, uint64_t &offset)
+{
+    if (sha.size() != SHA_DIGEST_LENGTH * 2)
+        return false;
+    string bin = hex_to_bin(sha);
+    const unsigned char *key = reinterpret_cast<const unsigned char *>(bin.data());
+
+    for (const pack_file &pack : get_packs())
+    {
+        uint32_t lo = key[0] == 0 ? 0 : get_be32(pack.fanout() + (key[0] - 1) * 4);
+        uint32_t hi = get_be32(pack.fanout() + key[0] * 4);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(pack.oids() + (size_t)mid * SHA_DIGEST_LENGTH, key, SHA_DIGEST_LENGTH);
+            if (cmp == 0)
+            {
+                found = &pack;
+                offset = get_be64(pack.offsets() + (size_t)mid * 8);
+                return true;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    return false;
+}
+
+// to read a file that may legitimately be missing, empty string if it is not there
+string read_file_if_exists(const string &filename)
+{
+    ifstream ifs(filename, ios::binary);
+    if (!ifs)
+        return "";
+    ostringstream oss;
+    oss << ifs.rdbuf();
+    return oss.str();
+}
+
+// to read a base-128 varint, returns false if it runs past the end
+bool get_varint(const unsigned char *&p, const unsigned char *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *p++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void put_varint(string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// to locate a pack entry: full objects store their inflated size, deltas
+// (type 2) first store how far back their base entry starts and then the
+// inflated size of the delta; both are followed by the compressed size and data
+bool pack_entry_at(const pack_file &pack, uint64_t offset, unsigned char &type, uint64_t &size,
+                   const unsigned char *&data, uint64_t &data_size, uint64_t *base_offset = nullptr)
+{
+    const unsigned char *end = pack.pack + pack.pack_size - SHA_DIGEST_LENGTH;
+    const unsigned char *p = pack.pack + offset;
+    if (offset < 12 || p >= end)
+        return false;
+    type = *p++;
+    if (type == pack_obj_ofs_delta)
+    {
+        uint64_t distance;
+        if (!get_varint(p, end, distance) || distance == 0 || distance > offset)
+            return false;
+        if (base_offset)
+            *base_offset = offset - distance;
+    }
+    else if (type != pack_obj_full)
+    {
+        return false;
+    }
+    if (!get_varint(p, end, size) || !get_varint(p, end, data_size) || data_size > (uint64_t)(end - p))
+        return false;
+    data = p;
+    return true;
+}
+
+// delta format: varint base size, varint result size, then instructions; a
+// byte with the high bit set copies from the base (bits 0-3 say which offset
+// bytes follow, bits 4-6 which size bytes follow), a byte 1..127 inserts that
+// many literal bytes taken from the delta itself
+bool apply_delta(const string &base, const string &delta, string &result)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(delta.data());
+    const unsigned char *end = p + delta.size();
+    uint64_t base_size, result_size;
+    if (!get_varint(p, end, base_size) || !get_varint(p, end, result_size) || base_size != base.size())
+        return false;
+
+    result.clear();
+    result.reserve(result_size);
+    while (p < end)
+    {
+        unsigned char op = *p++;
+        if (op & 0x80)
+        {
+            uint64_t offset = 0, size = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                if (op & (1 << i))
+                {
+                    if (p >= end)
+                        return false;
+                    offset |= uint64_t(*p++) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; ++i)
+            {
+                if (op & (0x10 << i))
+                {
+                    if (p >= end)
+                        return false;
+                    size |= uint64_t(*p++) << (8 * i);
+                }
+            }
+            if (size == 0 || offset + size > base.size())
+                return false;
+            result.append(base, offset, size);
+        }
+        else if (op != 0)
+        {
+            if ((size_t)(end - p) < op)
+                return false;
+            result.append(reinterpret_cast<const char *>(p), op);
+            p += op;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return result.size() == result_size;
+}
+
+// recently inflated delta bases, keyed by pack and offset and bounded in bytes,
+// so walking a delta chain (or many deltas against one base) inflates each base once
+class delta_base_cache
+{
+public:
+    explicit delta_base_cache(size_t limit) : limit(limit), used(0) {}
+
+    shared_ptr<const string> get(const string &pack, uint64_t offset)
+    {
+        lock_guard<mutex> lock(m);
+        auto it = entries.find(key(pack, offset));
+        if (it == entries.end())
+            return nullptr;
+        order.splice(order.begin(), order, it->second.pos);
+        return it->second.content;
+    }
+
+    void put(const string &pack, uint64_t offset, shared_ptr<const string> content)
+    {
+        if (content->size() > limit)
+            return;
+        lock_guard<mutex> lock(m);
+        string k = key(pack, offset);
+        if (entries.count(k))
+            return;
+        order.push_front(k);
+        entries[k] = {content, order.begin()};
+        used += content->size();
+        while (used > limit && !order.empty())
+        {
+            auto last = entries.find(order.back());
+            used -= last->second.content->size();
+            entries.erase(last);
+            order.pop_back();
+        }
+    }
+
+private:
+    struct cached
+    {
+        shared_ptr<const string> content;
+        list<string>::iterator pos;
+    };
+
+    static string key(const string &pack, uint64_t offset)
+    {
+        return pack + ":" + to_string(offset);
+    }
+
+    size_t limit;
+    size_t used;
+    mutex m;
+    list<string> order;
+    unordered_map<string, cached> entries;
+};
+
+delta_base_cache &get_delta_base_cache()
+{
+    static delta_base_cache cache(32 << 20);
+    return cache;
+}
+
+// to inflate the entry at offset, resolving delta chains through their bases
+bool unpack_entry(const pack_file &pack, uint64_t offset, string &content, int depth = 0)
+{
+    unsigned char type;
+    uint64_t size, data_size, base_offset = 0;
+    const unsigned char *data;
+    if (depth > 10000 || !pack_entry_at(pack, offset, type, size, data, data_size, &base_offset))
+        return false;
+
+    // the inflated size is stored in the entry, so one exact allocation is enough
+    string inflated(size, '\0');
+    uLongf out_size = size;
+    {
+        trace_scope scope(phase_inflate);
+        if (uncompress(reinterpret_cast<Bytef *>(&inflated[0]), &out_size, data, data_size) != Z_OK || out_size != size)
+            return false;
+        trace_count(counter_bytes_inflated, out_size);
+    }
+
+    if (type == pack_obj_full)
+    {
+        content.swap(inflated);
+        return true;
+    }
+
+    delta_base_cache &cache = get_delta_base_cache();
+    shared_ptr<const string> base = cache.get(pack.pack_path, base_offset);
+    if (!base)
+    {
+        string base_content;
+        if (!unpack_entry(pack, base_offset, base_content, depth + 1))
+            return false;
+        base = make_shared<const string>(move(base_content));
+        cache.put(pack.pack_path, base_offset, base);
+    }
+    return apply_delta(*base, inflated, content);
+}
+
+// every object starts with a "type size\0" header and its SHA-1 covers the
+// header too (same as git); objects written before headers existed have none
+string object_header(const string &type, uint64_t size)
+{
+    return type + " " + to_string(size) + string(1, '\0');
+}
+
+// to parse the header at the start of data, returns its length or 0 if there is none
+size_t parse_object_header(const char *data, size_t len, string &type, uint64_t &size)
+{
+    const char *nul = static_cast<const char *>(memchr(data, '\0', min<size_t>(len, 32)));
+    if (!nul)
+        return 0;
+    const char *space = static_cast<const char *>(memchr(data, ' ', nul - data));
+    if (!space || space + 1 == nul)
+        return 0;
+    string t(data, space);
+    if (t != "blob" && t != "tree" && t != "commit")
+        return 0;
+    uint64_t value = 0;
+    for (const char *p = space + 1; p < nul; ++p)
+    {
+        if (!isdigit(static_cast<unsigned char>(*p)))
+            return 0;
+        value = value * 10 + (*p - '0');
+    }
+    type = t;
+    size = value;
+    return nul - data + 1;
+}
+
+// objects written before headers existed: tell commits and trees from blobs by their content
+string guess_legacy_type(const string &content)
+{
+    if (starts_with(content, "tree ") && content.find("\nauthor ") != string::npos)
+        return "commit";
+    istringstream iss(content);
+    string line;
+    bool any = false;
+    while (getline(iss, line))
+    {
+        if (!(starts_with(line, "blob ") || starts_with(line, "tree ")) || line.size() < 47 || line[45] != ' ')
+            return "blob";
+        any = true;
+    }
+    return any ? "tree" : "blob";
+}
+
+// to turn a stored object (header + content) into its type and content in place
+bool split_object(string &raw, string &type, string &content)
+{
+    uint64_t size;
+    size_t header_len = parse_object_header(raw.data(), raw.size(), type, size);
+    if (header_len == 0)
+    {
+        type = guess_legacy_type(raw);
+        content.swap(raw);
+        return true;
+    }
+    if (raw.size() - header_len != size)
+        return false;
+    raw.erase(0, header_len);
+    content.swap(raw);
+    return true;
+}
+
+// to inflate a zlib stream holding an object: the header is inflated first into
+// a small buffer, then the rest goes straight into a buffer of exactly the
+// announced size; with header_only nothing past the header is inflated, and an
+// expected_type that does not match stops before the content is touched
+bool inflate_object(const unsigned char *data, size_t len, string &type, uint64_t &size, string *content,
+                    bool keep_header = false, const char *expected_type = nullptr)
+{
+    trace_scope scope(phase_inflate);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return false;
+    zs.next_in = const_cast<Bytef *>(data);
+    zs.avail_in = len;
+
+    char head[64];
+    zs.next_out = reinterpret_cast<Bytef *>(head);
+    zs.avail_out = sizeof(head);
+    int ret = inflate(&zs, Z_SYNC_FLUSH);
+    size_t have = sizeof(head) - zs.avail_out;
+    if (ret != Z_OK && ret != Z_STREAM_END)
+    {
+        inflateEnd(&zs);
+        return false;
+    }
+
+    size_t header_len = parse_object_header(head, have, type, size);
+    if (header_len == 0)
+    {
+        // no header (old object): the size is unknown, grow the buffer as needed
+        string out(head, have);
+        while (ret == Z_OK)
+        {
+            size_t old_size = out.size();
+            out.resize(max<size_t>(old_size * 2, 4096));
+            zs.next_out = reinterpret_cast<Bytef *>(&out[old_size]);
+            zs.avail_out = out.size() - old_size;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            out.resize(out.size() - zs.avail_out);
+        }
+        inflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+            return false;
+        trace_count(counter_bytes_inflated, out.size());
+        type = guess_legacy_type(out);
+        size = out.size();
+        if (content)
+            content->swap(out);
+        return true;
+    }
+
+    if (!content || (expected_type && type != expected_type))
+    {
+        inflateEnd(&zs);
+        return !content;
+    }
+
+    size_t skip = keep_header ? 0 : header_len;
+    size_t total = header_len + size;
+    if (have > total)
+    {
+        inflateEnd(&zs);
+        return false;
+    }
+    content->resize(total - skip);
+    memcpy(&(*content)[0], head + skip, have - skip);
+
+    if (ret != Z_STREAM_END)
+    {
+        size_t done = have - skip;
+        zs.next_out = reinterpret_cast<Bytef *>(&(*content)[0] + done);
+        zs.avail_out = content->size() - done;
+        ret = inflate(&zs, Z_FINISH);
+        // the end-of-stream marker can still be pending once the buffer is full
+        if (ret == Z_BUF_ERROR && zs.avail_out == 0)
+        {
+            char scratch;
+            zs.next_out = reinterpret_cast<Bytef *>(&scratch);
+            zs.avail_out = 1;
+            ret = inflate(&zs, Z_FINISH);
+        }
+    }
+    bool ok = (ret == Z_STREAM_END && zs.total_out == total);
+    trace_count(counter_bytes_inflated, zs.total_out);
+    inflateEnd(&zs);
+    return ok;
+}
+
+bool read_packed_object(const string &sha, string &raw)
+{
+    const pack_file *pack;
+    uint64_t offset;
+    if (!find_packed_object(sha, pack, offset))
+        return false;
+
+    if (!unpack_entry(*pack, offset, raw))
+    {
+        cerr << "Corrupt pack entry for object: " << sha << endl;
+        return false;
+    }
+    return true;
+}
+
+string loose_object_path(const string &sha)
+{
+    return ".mygit/objects/" + sha.substr(0, 2) + "/" + sha.substr(2);
+}
+
+// to read an object as it is stored (header + content), packs first, then loose
+bool read_raw_object(const string &sha, string &raw)
+{
+    if (sha.size() < 3)
+        return false;
+    if (read_packed_object(sha, raw))
+        return true;
+
+    string compressed = read_file_if_exists(loose_object_path(sha));
+    if (compressed.empty())
+        return false;
+    string type;
+    uint64_t size;
+    return inflate_object(reinterpret_cast<const unsigned char *>(compressed.data()), compressed.size(),
+                          type, size, &raw, true);
+}
+
+// to read and inflate an object, looking in the packs first and then in the
+// loose object directory; returns false if the object does not exist or is
+// not of expected_type (when given)
+bool read_object(const string &sha, string &content, string *type_out = nullptr,
+                 const char *expected_type = nullptr)
+{
+    if (sha.size() < 3)
+        return false;
+    trace_count(counter_objects_read);
+
+    string type;
+    string raw;
+    if (read_packed_object(sha, raw))
+    {
+        if (!split_object(raw, type, content))
+            return false;
+    }
+    else
+    {
+        string compressed = read_file_if_exists(loose_object_path(sha));
+        if (compressed.empty())
+            return false;
+        uint64_t size;
+        if (!inflate_object(reinterpret_cast<const unsigned char *>(compressed.data()), compressed.size(),
+                            type, size, &content, false, expected_type))
+        {
+            if (type_out)
+                *type_out = type;
+            return false;
+        }
+    }
+    if (type_out)
+        *type_out = type;
+    return !expected_type || type == expected_type;
+}
+
+// to find the type and size of an object while inflating as little as possible
+bool read_object_header(const string &sha, string &type, uint64_t &size)
+{
+    const pack_file *pack;
+    uint64_t offset;
+    if (find_packed_object(sha, pack, offset))
+    {
+        unsigned char entry_type;
+        uint64_t entry_size, data_size;
+        const unsigned char *data;
+        if (pack_entry_at(*pack, offset, entry_type, entry_size, data, data_size) && entry_type == pack_obj_full &&
+            inflate_object(data, data_size, type, size, nullptr))
+            return true;
+
+        // a delta (or an old object without header) has to be rebuilt
+        string raw, content;
+        if (!read_packed_object(sha, raw) || !split_object(raw, type, content))
+            return false;
+        size = content.size();
+        return true;
+    }
+
+    // the compressed header fits in the first few bytes of the file
+    string filename = loose_object_path(sha);
+    ifstream ifs(filename, ios::binary);
+    if (!ifs)
+        return false;
+    string prefix(256, '\0');
+    ifs.read(&prefix[0], prefix.size());
+    prefix.resize(ifs.gcount());
+    if (inflate_object(reinterpret_cast<const unsigned char *>(prefix.data()), prefix.size(), type, size, nullptr) &&
+        !type.empty())
+        return true;
+
+    string content;
+    return read_object(sha, content, &type) && (size = content.size(), true);
+}
+
+bool object_exists(const string &sha)
+{
+    const pack_file *pack;
+    uint64_t offset;
+    if (find_packed_object(sha, pack, offset))
+        return true;
+    struct stat buffer;
+    trace_count(counter_stat);
+    return stat(loose_object_path(sha).c_str(), &buffer) == 0;
+}
+
+// to compute the SHA-1 of an object the way it is stored: header + content
+string hash_object(const string &type, const string &data)
+{
+    trace_scope scope(phase_hash);
+    sha1 ctx;
+    ctx.update(object_header(type, data.size()));
+    ctx.update(data);
+    return ctx.final_hex();
+}
+
+// loose objects are written to a temp file and renamed into place, so a crash
+// never leaves a truncated object behind. core.fsyncMethod says how they reach
+// the disk: "batch" (default) syncs the filesystem once before the index or
+// HEAD is updated (and at exit), "fsync" syncs every object, "none" never syncs
+string get_fsync_method()
+{
+    static string method = get_config("core.fsyncMethod", "batch");
+    return method;
+}
+
+// fan-out directories (.mygit/objects/xx) this process already created or found
+atomic<bool> fanout_dir_ready[256];
+
+// set when an object was renamed into place but not synced yet
+atomic<bool> object_sync_pending(false);
+
+bool sync_object_writes();
+
+// to create the fan-out directory of hash unless this process already has
+bool make_fanout_dir(const string &hash)
+{
+    unsigned slot = hex_value(hash[0]) * 16 + hex_value(hash[1]);
+    if (fanout_dir_ready[slot].load(memory_order_relaxed))
+        return true;
+    string dir = ".mygit/objects/" + hash.substr(0, 2);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        cerr << "Failed to create directory: " << dir << endl;
+        return false;
+    }
+    fanout_dir_ready[slot] = true;
+    return true;
+}
+
+// to close a finished temp object file and rename it to the object's path;
+// the file is synced right away or left for sync_object_writes
+bool finish_object_file(int fd, const string &tmp_path, const string &hash)
+{
+    bool ok = true;
+    if (get_fsync_method() == "fsync")
+        ok = fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+    string filename = loose_object_path(hash);
+    if (!ok || !make_fanout_dir(hash) || rename(tmp_path.c_str(), filename.c_str()) != 0)
+    {
+        cerr << "Failed to write object: " << filename << endl;
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    if (get_fsync_method() == "batch" && !object_sync_pending.exchange(true))
+    {
+        static once_flag registered;
+        call_once(registered, []() { atexit([]() { sync_object_writes(); }); });
+    }
+    trace_count(counter_objects_written);
+    return true;
+}
+
+// to make every object written so far durable with one syncfs() call; has to
+// run before anything that points at the objects (index, HEAD) is written,
+// and when it fails nothing may point at them
+bool sync_object_writes()
+{
+    if (!object_sync_pending.exchange(false))
+        return true;
+    int fd = open(".mygit/objects", O_RDONLY | O_DIRECTORY);
+    bool ok = fd >= 0 && syncfs(fd) == 0;
+    if (!ok)
+        cerr << "Failed to sync objects: " << strerror(errno) << endl;
+    if (fd >= 0)
+        close(fd);
+    return ok;
+}
+
+// to compress an object that already has its header and write it as a loose
+// object, false (with a message) if it could not be written
+bool write_loose_object(const string &hash, const string &object)
+{
+    trace_scope scope(phase_object_write);
+
+    //compress data
+    uLongf compressed_size = compressBound(object.size());
+    string compressed_data(compressed_size, '\0');
+    {
+        trace_scope compress_scope(phase_compress);
+        if (compress(reinterpret_cast<Bytef *>(&compressed_data[0]), &compressed_size,
+                     reinterpret_cast<const Bytef *>(object.data()), object.size()) != Z_OK)
+        {
+            cerr << "Failed to compress object: " << hash << endl;
+            return false;
+        }
+    }
+    compressed_data.resize(compressed_size);
+    trace_count(counter_bytes_deflated, object.size());
+
+    if (!make_fanout_dir(hash))
+    {
+        cerr << "Failed to write blob: " << loose_object_path(hash) << endl;
+        return false;
+    }
+    string tmp_path = ".mygit/objects/" + hash.substr(0, 2) + "/tmp_obj_XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0)
+    {
+        cerr << "Failed to write blob: " << loose_object_path(hash) << endl;
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    size_t written = 0;
+    while (written < compressed_data.size())
+    {
+        ssize_t n = write(fd, compressed_data.data() + written, compressed_data.size() - written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    if (written != compressed_data.size())
+    {
+        cerr << "Failed to write blob: " << loose_object_path(hash) << endl;
+        close(fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return finish_object_file(fd, tmp_path, hash);
+}
+
+// store a compressed object (header + data) into the .mygit/objects directory,
+// false if it is not there and could not be written
+bool store_blob(const string &hash, const string &data, const string &type = "blob")
+{
+    // Check if the object already exists (loose or packed)
+    if (object_exists(hash))
+    {
+        // cout << "Object already exists: " << hash << endl;
+        return true;
+    }
+    return write_loose_object(hash, object_header(type, data.size()) + data);
+}
+
+// an inflated object as handed out by the object store
+struct stored_object
+{
+    string type;
+    string content;
+};
+
+// one place where commands read and write objects; inflated objects are kept
+// in an LRU cache bounded by core.objectCacheLimit (bytes) so walking history
+// or restoring a tree inflates every object at most once
+class object_store
+{
+public:
+    explicit object_store(size_t limit) : limit(limit), used(0), hits(0), misses(0) {}
+
+    // returns nullptr if the object does not exist or is not of expected_type
+    shared_ptr<const stored_object> read(const string &sha, const char *expected_type = nullptr)
+    {
+        {
+            lock_guard<mutex> lock(m);
+            auto it = entries.find(sha);
+            if (it != entries.end())
+            {
+                ++hits;
+                trace_count(counter_cache_hits);
+                order.splice(order.begin(), order, it->second.pos);
+                shared_ptr<const stored_object> obj = it->second.obj;
+                if (expected_type && obj->type != expected_type)
+                    return nullptr;
+                return obj;
+            }
+            ++misses;
+            trace_count(counter_cache_misses);
+        }
+
+        auto obj = make_shared<stored_object>();
+        if (!read_object(sha, obj->content, &obj->type, expected_type))
+            return nullptr;
+        insert(sha, obj);
+        return obj;
+    }
+
+    // to find the type and size, from the cache if the object was already inflated
+    bool header(const string &sha, string &type, uint64_t &size)
+    {
+        {
+            lock_guard<mutex> lock(m);
+            auto it = entries.find(sha);
+            if (it != entries.end())
+            {
+                ++hits;
+                trace_count(counter_cache_hits);
+                type = it->second.obj->type;
+                size = it->second.obj->content.size();
+                return true;
+            }
+        }
+        return read_object_header(sha, type, size);
+    }
+
+    // to hash and store an object, returns its SHA-1 or "" if it could not be written
+    string write(const string &type, const string &data)
+    {
+        string sha = hash_object(type, data);
+        return store_blob(sha, data, type) ? sha : "";
+    }
+
+    bool exists(const string &sha)
+    {
+        {
+            lock_guard<mutex> lock(m);
+            if (entries.count(sha))
+                return true;
+        }
+        return object_exists(sha);
+    }
+
+    size_t cache_hits() const { return hits; }
+    size_t cache_misses() const { return misses; }
+
+private:
+    void insert(const string &sha, shared_ptr<const stored_object> obj)
+    {
+        if (obj->content.size() > limit)
+            return;
+        lock_guard<mutex> lock(m);
+        if (entries.count(sha))
+            return;
+        order.push_front(sha);
+        entries[sha] = {obj, order.begin()};
+        used += obj->content.size();
+        while (used > limit && !order.empty())
+        {
+            auto last = entries.find(order.back());
+            used -= last->second.obj->content.size();
+            entries.erase(last);
+            order.pop_back();
+        }
+    }
+
+    struct cached
+    {
+        shared_ptr<const stored_object> obj;
+        list<string>::iterator pos;
+    };
+
+    size_t limit;
+    size_t used;
+    atomic<size_t> hits;
+    atomic<size_t> misses;
+    mutex m;
+    list<string> order;
+    unordered_map<string, cached> entries;
+};
+
+void print_object_cache_stats();
+
+// with MYGIT_STATS set, the cache hit/miss counters are printed to stderr on exit
+object_store &get_object_store()
+{
+    static object_store store(strtoull(get_config("core.objectCacheLimit", "67108864").c_str(), nullptr, 10));
+    static once_flag registered;
+    call_once(registered, []()
+    {
+        if (getenv("MYGIT_STATS"))
+            atexit(print_object_cache_stats);
+    });
+    return store;
+}
+
+void print_object_cache_stats()
+{
+    object_store &store = get_object_store();
+    cerr << "object cache: " << store.cache_hits() << " hits, " << store.cache_misses() << " misses" << endl;
+}
+
+// to store a staged file together with the stat data it had when it was hashed,
+// so unchanged files can reuse the SHA without being read again
+struct index_entry
+{
+    // path relative to the worktree, the sort key of the index
+    string path;
+    string sha;
+    int64_t ctime_sec = 0;
+    int64_t ctime_nsec = 0;
+    int64_t mtime_sec = 0;
+    int64_t mtime_nsec = 0;
+    uint64_t ino = 0;
+    uint32_t mode = 0;
+    uint64_t size = 0;
+};
+
+// tree SHA-1 of a directory as built from the index; entry_count is the number
+// of index entries below the directory, -1 once one of them changed
+struct cache_tree
+{
+    string sha;
+    int32_t entry_count = -1;
+    map<string, unique_ptr<cache_tree>> subtrees;
+};
+
+// .mygit/index loaded once per command, entries sorted by path
+struct index_state
+{
+    vector<index_entry> entries;
+    cache_tree tree;
+    // last fsmonitor token, "add ." only looks at what changed after it
+    string fsmonitor_token;
+    // mtime (seconds) of the index file when it was read; an entry modified in
+    // or after that second is "racily clean" and has to be rehashed
+    int64_t timestamp = 0;
+    atomic<bool> dirty{false};
+};
+
+const size_t index_entry_fixed_size = 8 + 4 + 8 + 4 + 8 + 4 + 8 + SHA_DIGEST_LENGTH + 2;
+const uint32_t index_version = 2;
+
+bool index_entry_less(const index_entry &a, const index_entry &b)
+{
+    return a.path < b.path;
+}
+
+// the "TREE" extension stores the cache-tree depth first: name, NUL, entry count
+// (0xffffffff when invalid), number of subdirectories and, when valid, the SHA-1
+void put_cache_tree(string &out, const string &name, const cache_tree &node)
+{
+    out += name;
+    out.push_back('\0');
+    put_be32(out, node.entry_count < 0 ? 0xffffffff : (uint32_t)node.entry_count);
+    put_be32(out, node.subtrees.size());
+    if (node.entry_count >= 0)
+        out += hex_to_bin(node.sha);
+    for (const auto &sub : node.subtrees)
+        put_cache_tree(out, sub.first, *sub.second);
+}
+
+bool get_cache_tree(const unsigned char *&p, const unsigned char *end, cache_tree &node, string &name)
+{
+    const unsigned char *nul = static_cast<const unsigned char *>(memchr(p, '\0', end - p));
+    if (!nul || end - nul < 9)
+        return false;
+    name.assign(reinterpret_cast<const char *>(p), nul - p);
+    p = nul + 1;
+    uint32_t count = get_be32(p);
+    uint32_t subtrees = get_be32(p + 4);
+    p += 8;
+    if (count != 0xffffffff)
+    {
+        if (end - p < SHA_DIGEST_LENGTH)
+            return false;
+        node.entry_count = count;
+        node.sha = bin_to_hex(p, SHA_DIGEST_LENGTH);
+        p += SHA_DIGEST_LENGTH;
+    }
+    for (uint32_t i = 0; i < subtrees; ++i)
+    {
+        unique_ptr<cache_tree> sub(new cache_tree);
+        string sub_name;
+        if (!get_cache_tree(p, end, *sub, sub_name))
+            return false;
+        node.subtrees[sub_name] = move(sub);
+    }
+    return true;
+}
+
+// index file layout: "DIRC", version, entry count, then for every entry (sorted
+// by path) ctime, mtime, inode, mode, size, binary SHA-1 and the length-prefixed
+// path; then optional extensions (4-byte name, 32-bit length, data) and a SHA-1
+// of everything before it
+index_state *load_index()
+{
+    index_state *index = new index_state;
+
+    struct stat st;
+    if (stat(".mygit/index", &st) != 0)
+        return index;
+    index->timestamp = st.st_mtim.tv_sec;
+
+    ifstream ifs(".mygit/index", ios::binary);
+    ostringstream oss;
+    oss << ifs.rdbuf();
+    string data = oss.str();
+
+    if (data.size() < 12 || data.compare(0, 4, "DIRC") != 0)
+    {
+        // older text index ("sha path" lines), no stat data so every file gets rehashed once
+        istringstream iss(data);
+        string line;
+        while (getline(iss, line))
+        {
+            size_t space = line.find(' ');
+            if (space != SHA_DIGEST_LENGTH * 2)
+                continue;
+            index_entry e;
+            e.path = normalize_path(line.substr(space + 1));
+            e.sha = line.substr(0, space);
+            index->entries.push_back(e);
+        }
+        stable_sort(index->entries.begin(), index->entries.end(), index_entry_less);
+        return index;
+    }
+
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+    const unsigned char *end = p + data.size();
+    uint32_t version = get_be32(p + 4);
+    uint32_t count = get_be32(p + 8);
+
+    if (version >= 2)
+    {
+        // verify the trailing checksum before trusting any entry
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        if (data.size() < 12 + SHA_DIGEST_LENGTH)
+        {
+            cerr << "Index file is corrupt, ignoring it." << endl;
+            return index;
+        }
+        end -= SHA_DIGEST_LENGTH;
+        sha1_buffer(p, end - p, hash);
+        if (memcmp(hash, end, SHA_DIGEST_LENGTH) != 0)
+        {
+            cerr << "Index file checksum mismatch, ignoring it." << endl;
+            return index;
+        }
+    }
+
+    index->entries.reserve(count);
+    p += 12;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (end - p < (ptrdiff_t)index_entry_fixed_size)
+            break;
+        index_entry e;
+        e.ctime_sec = get_be64(p);
+        e.ctime_nsec = get_be32(p + 8);
+        e.mtime_sec = get_be64(p + 12);
+        e.mtime_nsec = get_be32(p + 20);
+        e.ino = get_be64(p + 24);
+        e.mode = get_be32(p + 32);
+        e.size = get_be64(p + 36);
+        e.sha = bin_to_hex(p + 44, SHA_DIGEST_LENGTH);
+        size_t path_len = (p[64] << 8) | p[65];
+        p += index_entry_fixed_size;
+        if ((size_t)(end - p) < path_len)
+            break;
+        e.path.assign(reinterpret_cast<const char *>(p), path_len);
+        p += path_len;
+        index->entries.push_back(move(e));
+    }
+
+    // extensions, unknown ones are skipped
+    while (index->entries.size() == count && end - p >= 8)
+    {
+        uint32_t len = get_be32(p + 4);
+        const unsigned char *ext = p + 8;
+        if ((uint64_t)(end - ext) < len)
+            break;
+        if (memcmp(p, "TREE", 4) == 0)
+        {
+            string name;
+            const unsigned char *q = ext;
+            if (!get_cache_tree(q, ext + len, index->tree, name))
+                index->tree = cache_tree();
+        }
+        else if (memcmp(p, "FSMN", 4) == 0)
+            index->fsmonitor_token.assign(reinterpret_cast<const char *>(ext), len);
+        p = ext + len;
+    }
+
+    // version 1 files were written from a map and are sorted already, but do not rely on it
+    if (!is_sorted(index->entries.begin(), index->entries.end(), index_entry_less))
+        stable_sort(index->entries.begin(), index->entries.end(), index_entry_less);
+    return index;
+}
+
+index_state &get_index()
+{
+    static unique_ptr<index_state> index(load_index());
+    return *index;
+}
+
+// to find the entry of a path with a binary search, nullptr if it is not staged
+index_entry *index_find(const string &path)
+{
+    vector<index_entry> &entries = get_index().entries;
+    auto it = lower_bound(entries.begin(), entries.end(), path,
+                          [](const index_entry &e, const string &key) { return e.path < key; });
+    if (it == entries.end() || it->path != path)
+        return nullptr;
+    return &*it;
+}
+
+// to merge newly staged entries into the sorted index in one pass
+void index_add_entries(vector<index_entry> &added)
+{
+    if (added.empty())
+        return;
+    index_state &index = get_index();
+    stable_sort(added.begin(), added.end(), index_entry_less);
+
+    vector<index_entry> merged;
+    merged.reserve(index.entries.size() + added.size());
+    merge(make_move_iterator(index.entries.begin()), make_move_iterator(index.entries.end()),
+          make_move_iterator(added.begin()), make_move_iterator(added.end()),
+          back_inserter(merged), index_entry_less);
+
+    // a path given twice keeps its last version
+    auto last = unique(merged.rbegin(), merged.rend(),
+                       [](const index_entry &a, const index_entry &b) { return a.path == b.path; });
+    merged.erase(merged.begin(), last.base());
+    index.entries.swap(merged);
+    index.dirty = true;
+}
+
+// to mark the cached trees of every directory above path as stale
+void cache_tree_invalidate(const string &path)
+{
+    index_state &index = get_index();
+    cache_tree *node = &index.tree;
+    node->entry_count = -1;
+    size_t start = 0, slash;
+    while ((slash = path.find('/', start)) != string::npos)
+    {
+        auto it = node->subtrees.find(path.substr(start, slash - start));
+        if (it == node->subtrees.end())
+            break;
+        node = it->second.get();
+        node->entry_count = -1;
+        start = slash + 1;
+    }
+    index.dirty = true;
+}
+
+// to drop a path from the index, false if it was not staged
+bool index_remove(const string &path)
+{
+    index_state &index = get_index();
+    index_entry *e = index_find(path);
+    if (!e)
+        return false;
+    index.entries.erase(index.entries.begin() + (e - index.entries.data()));
+    cache_tree_invalidate(path);
+    return true;
+}
+
+// a command that changes the index creates .mygit/index.lock before it reads
+// the index and holds it until write_index renames it over the index, so two
+// commands never both start from the same index and lose each other's entries.
+// the lock is removed when the command exits (or is killed) without writing
+const char *const index_lock_path = ".mygit/index.lock";
+
+struct index_lock
+{
+    int fd = -1;
+
+    ~index_lock()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(index_lock_path);
+        }
+    }
+};
+
+index_lock &get_index_lock()
+{
+    static index_lock lock;
+    return lock;
+}
+
+void remove_index_lock_on_signal(int sig)
+{
+    unlink(index_lock_path);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// to take the index lock, false (with a message) if another command holds it
+bool lock_index()
+{
+    index_lock &lock = get_index_lock();
+    if (lock.fd >= 0)
+        return true;
+    lock.fd = open(index_lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (lock.fd < 0)
+    {
+        cerr << "Unable to create " << index_lock_path << ": " << strerror(errno) << endl;
+        if (errno == EEXIST)
+            cerr << "Another mygit process seems to be running in this repository." << endl;
+        return false;
+    }
+    for (int sig : {SIGINT, SIGTERM, SIGHUP})
+        signal(sig, remove_index_lock_on_signal);
+    return true;
+}
+
+// to write the whole index once per command: the new content goes to the
+// index lock (taken here if the command did not take it first), which is then
+// renamed over the index
+bool write_index()
+{
+    index_state &index = get_index();
+    if (!sync_object_writes())
+        return false;
+
+    string out = "DIRC";
+    put_be32(out, index_version);
+    put_be32(out, index.entries.size());
+    for (const index_entry &e : index.entries)
+    {
+        put_be64(out, e.ctime_sec);
+        put_be32(out, e.ctime_nsec);
+        put_be64(out, e.mtime_sec);
+        put_be32(out, e.mtime_nsec);
+        put_be64(out, e.ino);
+        put_be32(out, e.mode);
+        put_be64(out, e.size);
+        out += hex_to_bin(e.sha);
+        out.push_back(static_cast<char>((e.path.size() >> 8) & 0xff));
+        out.push_back(static_cast<char>(e.path.size() & 0xff));
+        out += e.path;
+    }
+    if (index.tree.entry_count >= 0 || !index.tree.subtrees.empty())
+    {
+        string ext;
+        put_cache_tree(ext, "", index.tree);
+        out += "TREE";
+        put_be32(out, ext.size());
+        out += ext;
+    }
+    if (!index.fsmonitor_token.empty())
+    {
+        out += "FSMN";
+        put_be32(out, index.fsmonitor_token.size());
+        out += index.fsmonitor_token;
+    }
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    sha1_buffer(out.data(), out.size(), hash);
+    out.append(reinterpret_cast<const char *>(hash), SHA_DIGEST_LENGTH);
+
+    if (!lock_index())
+        return false;
+    index_lock &lock = get_index_lock();
+    int fd = lock.fd;
+    lock.fd = -1;
+
+    size_t written = 0;
+    while (written < out.size())
+    {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n <= 0)
+            break;
+        written += n;
+    }
+    bool ok = (written == out.size()) && fsync(fd) == 0;
+    ok = (close(fd) == 0) && ok;
+
+    if (!ok || rename(index_lock_path, ".mygit/index") != 0)
+    {
+        cerr << "Failed to write index file." << endl;
+        unlink(index_lock_path);
+        return false;
+    }
+    index.dirty = false;
+    return true;
+}
+
+void fill_stat_data(index_entry &e, const struct stat &st)
+{
+    e.ctime_sec = st.st_ctim.tv_sec;
+    e.ctime_nsec = st.st_ctim.tv_nsec;
+    e.mtime_sec = st.st_mtim.tv_sec;
+    e.mtime_nsec = st.st_mtim.tv_nsec;
+    e.ino = st.st_ino;
+    e.mode = st.st_mode;
+    e.size = st.st_size;
+}
+
+// the file type bits of an index entry whose object is a chunk list (see
+// store_chunked_file) instead of S_IFREG; stat never reports this type
+const uint32_t index_mode_chunked = 0110000;
+
+bool index_entry_chunked(const index_entry &e)
+{
+    return (e.mode & S_IFMT) == index_mode_chunked;
+}
+
+void mark_chunked(index_entry &e)
+{
+    e.mode = (e.mode & ~S_IFMT) | index_mode_chunked;
+}
+
+// true if the file still has the stat data recorded in the index and was not
+// modified in the same second the index was written (racily clean)
+bool index_entry_clean(const index_entry &e, const struct stat &st)
+{
+    if (e.mtime_sec != st.st_mtim.tv_sec || e.mtime_nsec != st.st_mtim.tv_nsec ||
+        e.ctime_sec != st.st_ctim.tv_sec || e.ctime_nsec != st.st_ctim.tv_nsec ||
+        e.size != (uint64_t)st.st_size || e.ino != st.st_ino || (e.mode & ~S_IFMT) != (st.st_mode & ~S_IFMT))
+        return false;
+    return e.mtime_sec < get_index().timestamp;
+}
+
+// chunk size used when hashing and compressing files as a stream
+const size_t stream_chunk_size = 1 << 16;
+
+// how many small files (below stream_chunk_size) add reads and hashes together
+const size_t add_batch_size = 64;
+
+// to read a small file into memory as a blob object (header + content), the
+// size has to match what stat reported
+bool read_blob_object(const string &path, const struct stat &st, string &object)
+{
+    trace_scope scope(phase_file_read);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "Failed to open file: " << path << endl;
+        return false;
+    }
+    object = object_header("blob", st.st_size);
+    size_t header_len = object.size();
+    object.resize(header_len + st.st_size + 1);
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, &object[header_len + total], object.size() - header_len - total)) > 0)
+        total += n;
+    close(fd);
+    if (n < 0)
+    {
+        cerr << "Failed to read file: " << path << endl;
+        return false;
+    }
+    if (total != (uint64_t)st.st_size)
+    {
+        cerr << "File changed while it was being hashed: " << path << endl;
+        return false;
+    }
+    object.resize(header_len + total);
+    return true;
+}
+
+// to hash a file in fixed-size chunks and, when write is set, deflate the same
+// chunks into a temp file under .mygit/objects that is renamed into place once
+// the SHA-1 is known; memory use stays the same whatever the file size
+bool hash_file_streaming(const string &path, bool write, string &sha_out)
+{
+    int in_fd = open(path.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        cerr << "Failed to open file: " << path << endl;
+        return false;
+    }
+
+    sha1 ctx;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    string tmp_path = ".mygit/objects/tmp_obj_XXXXXX";
+    int out_fd = -1;
+    if (write)
+    {
+        out_fd = mkstemp(&tmp_path[0]);
+        if (out_fd < 0 || deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            cerr << "Failed to create temporary object file for: " << path << endl;
+            if (out_fd >= 0)
+            {
+                close(out_fd);
+                unlink(tmp_path.c_str());
+            }
+            close(in_fd);
+            return false;
+        }
+    }
+
+    vector<unsigned char> in_buf(stream_chunk_size);
+    vector<unsigned char> out_buf(stream_chunk_size);
+    bool ok = true;
+
+    // the header needs the size up front, it is taken from fstat and checked at the end
+    struct stat st;
+    uint64_t expected_size = (fstat(in_fd, &st) == 0) ? st.st_size : 0;
+    uint64_t total_read = 0;
+    string header = object_header("blob", expected_size);
+
+    // to push the pending input through deflate and append the output to the temp file
+    auto deflate_chunk = [&](int flush)
+    {
+        int ret;
+        trace_scope scope(phase_compress);
+        do
+        {
+            zs.next_out = out_buf.data();
+            zs.avail_out = out_buf.size();
+            ret = deflate(&zs, flush);
+            size_t have = out_buf.size() - zs.avail_out;
+            if (have > 0 && ::write(out_fd, out_buf.data(), have) != (ssize_t)have)
+                ok = false;
+        } while (ok && (zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END)));
+    };
+
+    ctx.update(header);
+    if (write)
+    {
+        trace_count(counter_bytes_deflated, header.size());
+        zs.next_in = reinterpret_cast<Bytef *>(&header[0]);
+        zs.avail_in = header.size();
+        deflate_chunk(Z_NO_FLUSH);
+    }
+
+    while (ok)
+    {
+        ssize_t n;
+        {
+            trace_scope scope(phase_file_read);
+            n = read(in_fd, in_buf.data(), in_buf.size());
+        }
+        if (n < 0)
+        {
+            cerr << "Failed to read file: " << path << endl;
+            ok = false;
+            break;
+        }
+        if (n == 0)
+            break;
+        total_read += n;
+        {
+            trace_scope scope(phase_hash);
+            ctx.update(in_buf.data(), n);
+        }
+        if (write)
+        {
+            trace_count(counter_bytes_deflated, n);
+            zs.next_in = in_buf.data();
+            zs.avail_in = n;
+            deflate_chunk(Z_NO_FLUSH);
+        }
+    }
+    close(in_fd);
+    if (ok && total_read != expected_size)
+    {
+        cerr << "File changed while it was being hashed: " << path << endl;
+        ok = false;
+    }
+
+    sha_out = ctx.final_hex();
+
+    if (!write)
+        return ok;
+
+    if (ok)
+        deflate_chunk(Z_FINISH);
+    deflateEnd(&zs);
+    if (!ok)
+    {
+        cerr << "Failed to write blob: " << path << endl;
+        close(out_fd);
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // move the finished object into place unless it already exists
+    trace_scope scope(phase_object_write);
+    if (object_exists(sha_out))
+    {
+        close(out_fd);
+        unlink(tmp_path.c_str());
+        return true;
+    }
+    fchmod(out_fd, 0644);
+    return finish_object_file(out_fd, tmp_path, sha_out);
+}
+
+// content-defined chunking (FastCDC): a file of at least core.chunkThreshold
+// bytes (0, the default, turns it off) is cut where a gear hash of the bytes
+// before the cut has the bits of a mask all zero, so an edit only changes the
+// chunks around it. before the average size the mask has more bits than after
+// it, which keeps chunk sizes close to the average. every chunk is stored as a
+// blob, and the file as a blob of "<sha> <size>" lines (the chunk list); the
+// tree entry of a chunked file has mode 110644 / 110755, which tells them apart
+const size_t cdc_min_size = 256 << 10;
+const size_t cdc_avg_size = 1 << 20;
+const size_t cdc_max_size = 4 << 20;
+const uint64_t cdc_mask_small = ((1ULL << 22) - 1) << (64 - 22);
+const uint64_t cdc_mask_large = ((1ULL << 18) - 1) << (64 - 18);
+
+// chunks cut from the read window before they are hashed and stored together
+const size_t cdc_window_chunks = 16;
+
+uint64_t chunk_threshold()
+{
+    static const uint64_t threshold = strtoull(get_config("core.chunkThreshold", "0").c_str(), nullptr, 10);
+    return threshold;
+}
+
+bool is_chunked_mode(const string &mode)
+{
+    return starts_with(mode, "110");
+}
+
+// the gear table, 256 fixed pseudo-random values (splitmix64); changing it
+// would change every chunk boundary
+const uint64_t *cdc_gear()
+{
+    static const vector<uint64_t> gear = []()
+    {
+        vector<uint64_t> table(256);
+        uint64_t x = 0;
+        for (uint64_t &value : table)
+        {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return table;
+    }();
+    return gear.data();
+}
+
+// to find the length of the next chunk in data[0..n)
+size_t cdc_cut(const unsigned char *data, size_t n)
+{
+    if (n <= cdc_min_size)
+        return n;
+    const uint64_t *gear = cdc_gear();
+    size_t normal = min(n, cdc_avg_size), end = min(n, cdc_max_size);
+    uint64_t fp = 0;
+    size_t i = cdc_min_size;
+    for (; i < normal; ++i)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & cdc_mask_small))
+            return i + 1;
+    }
+    for (; i < end; ++i)
+    {
+        fp = (fp << 1) + gear[data[i]];
+        if (!(fp & cdc_mask_large))
+            return i + 1;
+    }
+    return end;
+}
+
+// to chunk a file and hash its chunk list; with write, chunks that are not in
+// the repository yet and the chunk list are stored. the file is read through a
+// window of cdc_window_chunks * cdc_max_size bytes, and the chunks cut from
+// each window are hashed and compressed on the thread pool
+bool store_chunked_file(const string &path, bool write, string &sha_out)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "Failed to open file: " << path << endl;
+        return false;
+    }
+    struct stat st;
+    uint64_t expected_size = (fstat(fd, &st) == 0) ? st.st_size : 0;
+
+    vector<unsigned char> window(cdc_window_chunks * cdc_max_size);
+    size_t have = 0;
+    uint64_t total = 0;
+    bool eof = false, ok = true;
+    string list;
+    while (ok)
+    {
+        {
+            trace_scope scope(phase_file_read);
+            while (!eof && have < window.size())
+            {
+                ssize_t n = read(fd, window.data() + have, window.size() - have);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n < 0)
+                {
+                    cerr << "Failed to read file: " << path << endl;
+                    ok = false;
+                    break;
+                }
+                eof = n == 0;
+                have += n;
+            }
+        }
+        if (!ok || have == 0)
+            break;
+
+        // a cut only looks at the next cdc_max_size bytes, so a shorter tail waits for the next read
+        vector<pair<size_t, size_t>> chunks;
+        size_t start = 0;
+        while (start < have && (eof || have - start >= cdc_max_size))
+        {
+            size_t len = cdc_cut(window.data() + start, have - start);
+            chunks.push_back({start, len});
+            start += len;
+        }
+
+        vector<string> shas(chunks.size());
+        atomic<bool> stored(true);
+        task_group group(get_pool());
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            group.run([&, i]()
+            {
+                const unsigned char *data = window.data() + chunks[i].first;
+                string header = object_header("blob", chunks[i].second);
+                sha1 ctx;
+                {
+                    trace_scope scope(phase_hash);
+                    ctx.update(header);
+                    ctx.update(data, chunks[i].second);
+                }
+                shas[i] = ctx.final_hex();
+                if (write && !object_exists(shas[i]) &&
+                    !write_loose_object(shas[i], header + string(reinterpret_cast<const char *>(data), chunks[i].second)))
+                    stored = false;
+            });
+        }
+        group.wait();
+        if (!stored)
+        {
+            ok = false;
+            break;
+        }
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            list += shas[i] + " " + to_string(chunks[i].second) + "\n";
+            total += chunks[i].second;
+        }
+
+        memmove(window.data(), window.data() + start, have - start);
+        have -= start;
+    }
+    close(fd);
+    if (ok && total != expected_size)
+    {
+        cerr << "File changed while it was being hashed: " << path << endl;
+        ok = false;
+    }
+    if (!ok)
+        return false;
+    sha_out = write ? get_object_store().write("blob", list) : hash_object("blob", list);
+    return !sha_out.empty();
+}
+
+// to read the chunks (SHA-1 and size) of a chunk list, false if it is missing or corrupt
+bool read_chunk_list(const string &sha, vector<pair<string, uint64_t>> &chunks)
+{
+    shared_ptr<const stored_object> list = get_object_store().read(sha, "blob");
+    if (!list)
+        return false;
+    istringstream iss(list->content);
+    string chunk;
+    uint64_t size;
+    while (iss >> chunk >> size)
+        chunks.push_back({chunk, size});
+    return iss.eof();
+}
+
+// true if a file is stored as chunks: it is at least core.chunkThreshold bytes,
+// or it is chunked in the index already (a clone may not have the setting)
+bool store_as_chunks(const index_entry *staged, const struct stat &st)
+{
+    return (staged && index_entry_chunked(*staged)) ||
+           (chunk_threshold() > 0 && (uint64_t)st.st_size >= chunk_threshold());
+}
+
+// to hash a file (its blob, or its chunk list when chunked is set) and store
+// it; a file whose stat data still matches the index reuses the staged SHA
+// without being read. false if the file could not be read or stored
+bool hash_and_store_file(const string &path, const struct stat &st, string &blob_sha, bool &chunked)
+{
+    index_entry *staged = index_find(normalize_path(path));
+    if (staged && index_entry_clean(*staged, st))
+    {
+        chunked = index_entry_chunked(*staged);
+        blob_sha = staged->sha;
+        return true;
+    }
+
+    chunked = store_as_chunks(staged, st);
+    if (!(chunked ? store_chunked_file(path, true, blob_sha) : hash_file_streaming(path, true, blob_sha)))
+        return false;
+
+    // same content as staged, only the stat data went stale (e.g. touched file)
+    if (staged && staged->sha == blob_sha)
+    {
+        fill_stat_data(*staged, st);
+        if (chunked)
+            mark_chunked(*staged);
+        get_index().dirty = true;
+    }
+    return true;
+}
+
+// trees are stored like git trees: entries sorted by name, each one
+// "<mode> <name>\0" followed by the 20-byte binary SHA-1; a directory sorts as
+// if its name ended in '/'. trees written by older versions are text lines of
+// "type sha name" in readdir order and are still read
+bool tree_entry_less(const tree_entry &a, const tree_entry &b)
+{
+    string ka = a.type == "tree" ? a.filename + "/" : a.filename;
+    string kb = b.type == "tree" ? b.filename + "/" : b.filename;
+    return ka < kb;
+}
+
+string encode_tree(vector<tree_entry> &entries)
+{
+    sort(entries.begin(), entries.end(), tree_entry_less);
+    string out;
+    for (const tree_entry &e : entries)
+    {
+        out += e.mode;
+        out.push_back(' ');
+        out += e.filename;
+        out.push_back('\0');
+        out += hex_to_bin(e.sha);
+    }
+    return out;
+}
+
+// to parse either tree encoding, the entries come back in canonical order
+bool parse_tree(const string &content, vector<tree_entry> &entries)
+{
+    if (!content.empty() && !isdigit(static_cast<unsigned char>(content[0])))
+    {
+        istringstream iss(content);
+        string line;
+        while (getline(iss, line))
+        {
+            istringstream entry_stream(line);
+            tree_entry entry;
+            entry_stream >> entry.type >> entry.sha >> entry.filename;
+            entry.mode = entry.type == "tree" ? "40000" : "100644";
+            entries.push_back(entry);
+        }
+        sort(entries.begin(), entries.end(), tree_entry_less);
+        return true;
+    }
+
+    size_t pos = 0;
+    while (pos < content.size())
+    {
+        size_t space = content.find(' ', pos);
+        size_t nul = space == string::npos ? string::npos : content.find('\0', space);
+        if (nul == string::npos || nul + 1 + SHA_DIGEST_LENGTH > content.size())
+            return false;
+        tree_entry entry;
+        entry.mode = content.substr(pos, space - pos);
+        entry.type = entry.mode == "40000" ? "tree" : "blob";
+        entry.filename = content.substr(space + 1, nul - space - 1);
+        entry.sha = bin_to_hex(reinterpret_cast<const unsigned char *>(content.data()) + nul + 1, SHA_DIGEST_LENGTH);
+        entries.push_back(entry);
+        pos = nul + 1 + SHA_DIGEST_LENGTH;
+    }
+    return true;
+}
+
+// to binary search a parsed tree for a name, nullptr if it is not there
+const tree_entry *find_tree_entry(const vector<tree_entry> &entries, const string &name)
+{
+    for (const char *type : {"blob", "tree"})
+    {
+        tree_entry key{type, "", name, ""};
+        auto it = lower_bound(entries.begin(), entries.end(), key, tree_entry_less);
+        if (it != entries.end() && it->filename == name && it->type == type)
+            return &*it;
+    }
+    return nullptr;
+}
+
+// to traverse a directory and collect its entries, subdirectories and files
+// are hashed as separate pool tasks; false if one of them could not be stored
+bool get_directory_entries(const string &path, vector<tree_entry> &result)
+{
+    vector<tree_entry> entries;
+    trace_scope walk_scope(phase_walk);
+    DIR *dir = opendir(path.c_str());
+
+    if (!dir)
+    {
+        cerr << "Failed to open directory: " << path << endl;
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        string name = entry->d_name;
+
+        // skip "." and ".." directories
+        if (name == "." || name == ".." || name==".mygit")
+            continue;
+
+        entries.push_back({"", "", name});
+    }
+    closedir(dir);
+
+    atomic<bool> ok(true);
+    task_group group(get_pool());
+    for (auto &e : entries)
+    {
+        tree_entry *slot = &e;
+        string fullPath = path + "/" + e.filename;
+        group.run([slot, fullPath, &ok]()
+        {
+            // see if the entry is a file or directory
+            struct stat st;
+            trace_count(counter_stat);
+            if (stat(fullPath.c_str(), &st) != 0)
+                return;
+
+            if (S_ISDIR(st.st_mode))
+            {
+                // recursively hash the directory (tree object)
+                slot->sha = write_tree(fullPath);
+                if (slot->sha.empty())
+                {
+                    ok = false;
+                    return;
+                }
+                slot->type = "tree";
+                slot->mode = "40000";
+            }
+            else if (S_ISREG(st.st_mode))
+            {
+                bool chunked;
+                if (!hash_and_store_file(fullPath, st, slot->sha, chunked))
+                {
+                    ok = false;
+                    return;
+                }
+                slot->type = "blob";
+                slot->mode = chunked ? "110" : "100";
+                slot->mode += (st.st_mode & S_IXUSR) ? "755" : "644";
+            }
+        });
+    }
+    group.wait();
+
+    // drop entries that are neither files nor directories
+    for (auto &e : entries)
+    {
+        if (!e.type.empty())
+            result.push_back(move(e));
+    }
+    return ok;
+}
+
+// to create a tree object and return its SHA-1 value, "" if a file or
+// directory below it could not be stored
+string write_tree(const string &path = ".")
+{
+    vector<tree_entry> entries;
+    if (!get_directory_entries(path, entries))
+        return "";
+
+    string tree_content = encode_tree(entries);
+
+    // Store the tree object (nothing is written if it already exists)
+    return get_object_store().write("tree", tree_content);
+}
+
+// to build the tree of the index entries from pos on that start with prefix;
+// directories whose cache-tree is still valid are taken as they are. "" if a
+// tree could not be written, the node then stays invalid
+string build_cache_tree(cache_tree &node, const vector<index_entry> &entries, size_t &pos, const string &prefix)
+{
+    if (node.entry_count >= 0)
+    {
+        pos += node.entry_count;
+        return node.sha;
+    }
+
+    size_t start = pos;
+    bool failed = false;
+    vector<tree_entry> tree;
+    map<string, unique_ptr<cache_tree>> subtrees;
+    while (pos < entries.size() && starts_with(entries[pos].path, prefix))
+    {
+        const index_entry &e = entries[pos];
+        size_t slash = e.path.find('/', prefix.size());
+        if (S_ISDIR(e.mode) && slash + 1 == e.path.size())
+        {
+            // a directory outside the sparse checkout keeps the tree it was checked out with
+            tree.push_back({"tree", e.sha, e.path.substr(prefix.size(), slash - prefix.size()), "40000"});
+            ++pos;
+            continue;
+        }
+        if (slash == string::npos)
+        {
+            string mode = index_entry_chunked(e) ? "110" : "100";
+            mode += (e.mode & S_IXUSR) ? "755" : "644";
+            tree.push_back({"blob", e.sha, e.path.substr(prefix.size()), mode});
+            ++pos;
+            continue;
+        }
+        string name = e.path.substr(prefix.size(), slash - prefix.size());
+        auto it = node.subtrees.find(name);
+        unique_ptr<cache_tree> sub = it != node.subtrees.end() ? move(it->second) : unique_ptr<cache_tree>(new cache_tree);
+        string sha = build_cache_tree(*sub, entries, pos, prefix + name + "/");
+        failed = failed || sha.empty();
+        tree.push_back({"tree", sha, name, "40000"});
+        subtrees[name] = move(sub);
+    }
+
+    // directories that no longer have entries are dropped with the old map
+    node.subtrees.swap(subtrees);
+    node.sha = failed ? "" : get_object_store().write("tree", encode_tree(tree));
+    node.entry_count = node.sha.empty() ? -1 : pos - start;
+    return node.sha;
+}
+
+// to write the tree of everything staged in the index, only the directories
+// above changed entries are rebuilt; "" if a tree could not be written
+string write_index_tree()
+{
+    index_state &index = get_index();
+    bool was_valid = index.tree.entry_count >= 0;
+    size_t pos = 0;
+    string sha = build_cache_tree(index.tree, index.entries, pos, "");
+    if (!was_valid)
+        index.dirty = true;
+    return sha;
+}
+
+// to read a tree object into its entries, false if it cannot be read
+bool read_tree(const string &tree_sha, vector<tree_entry> &entries)
+{
+    shared_ptr<const stored_object> tree = get_object_store().read(tree_sha, "tree");
+    if (!tree)
+        return false;
+    if (!parse_tree(tree->content, entries))
+    {
+        cerr << "Corrupt tree object: " << tree_sha << endl;
+        return false;
+    }
+    return true;
+}
+
+// to write the content of a blob to a file with the permissions of its tree entry mode
+bool restore_chunked_file(const string &list_sha, const string &path, const string &mode);
+
+bool restore_blob(const string &blob_sha, const string &fullPath, const string &mode = "100644")
+{
+    if (is_chunked_mode(mode))
+        return restore_chunked_file(blob_sha, fullPath, mode);
+
+    //read content of file
+    shared_ptr<const stored_object> blob = get_object_store().read(blob_sha, "blob");
+    if (!blob)
+    {
+        cerr << "Failed to open file: " << loose_object_path(blob_sha) << endl;
+        return false;
+    }
+
+    trace_scope scope(phase_file_write);
+    ofstream ofs(fullPath, ios::binary);
+    if (!ofs)
+    {
+        cerr << "Failed to restore file: " << fullPath << endl;
+        return false;
+    }
+    ofs << blob->content;
+    ofs.close();
+    if (!ofs)
+    {
+        cerr << "Failed to restore file: " << fullPath << endl;
+        return false;
+    }
+    chmod(fullPath.c_str(), mode == "100755" ? 0755 : 0644);
+    return true;
+}
+
+// chunks one pool task inflates and writes when a chunked file is restored
+const size_t restore_chunk_batch = 4;
+
+// to write a chunked file: the chunk list gives the offset of every chunk, so
+// batches of chunks are inflated and written with pwrite on the thread pool,
+// without ever holding the whole file in memory
+bool restore_chunked_file(const string &list_sha, const string &path, const string &mode)
+{
+    vector<pair<string, uint64_t>> chunks;
+    if (!read_chunk_list(list_sha, chunks))
+    {
+        cerr << "Failed to read chunk list: " << list_sha << endl;
+        return false;
+    }
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        cerr << "Failed to restore file: " << path << endl;
+        return false;
+    }
+
+    atomic<bool> ok(true);
+    task_group group(get_pool());
+    uint64_t offset = 0;
+    for (size_t begin = 0; begin < chunks.size(); begin += restore_chunk_batch)
+    {
+        size_t end = min(chunks.size(), begin + restore_chunk_batch);
+        group.run([&chunks, &ok, &path, fd, begin, end, offset]()
+        {
+            uint64_t at = offset;
+            for (size_t i = begin; i < end && ok; ++i)
+            {
+                // chunks bypass the object cache, they are used once
+                string content;
+                if (!read_object(chunks[i].first, content, nullptr, "blob") || content.size() != chunks[i].second)
+                {
+                    cerr << "Failed to read chunk " << chunks[i].first << " of " << path << endl;
+                    ok = false;
+                    return;
+                }
+                trace_scope scope(phase_file_write);
+                for (size_t done = 0; done < content.size();)
+                {
+                    ssize_t n = pwrite(fd, content.data() + done, content.size() - done, at + done);
+                    if (n <= 0)
+                    {
+                        cerr << "Failed to restore file: " << path << endl;
+                        ok = false;
+                        return;
+                    }
+                    done += n;
+                }
+                at += content.size();
+            }
+        });
+        for (size_t i = begin; i < end; ++i)
+            offset += chunks[i].second;
+    }
+    group.wait();
+    close(fd);
+    chmod(path.c_str(), mode == "110755" ? 0755 : 0644);
+    return ok;
+}
+
+// sparse checkout: .mygit/info/sparse-checkout lists directories, one per line
+// relative to the worktree. only those directories and the files directly in
+// the directories above them are checked out; every other subtree stays in the
+// index as one directory entry ("dir/", mode 040000, the tree SHA-1) that is
+// never read, so commits carry it forward as it is. without the file
+// everything is checked out
+const string sparse_checkout_path = ".mygit/info/sparse-checkout";
+
+struct sparse_checkout
+{
+    // sorted, without trailing slashes; empty means everything
+    vector<string> dirs;
+
+    bool active() const { return !dirs.empty(); }
+
+    // true if path is one of the directories or inside one
+    bool includes(const string &path) const
+    {
+        if (!active())
+            return true;
+        for (const string &dir : dirs)
+        {
+            if (starts_with(path, dir) && (path.size() == dir.size() || path[dir.size()] == '/'))
+                return true;
+        }
+        return false;
+    }
+
+    // true if checkout has to look into the directory path: it is one of the
+    // directories, inside one or above one
+    bool enters(const string &path) const
+    {
+        if (includes(path))
+            return true;
+        for (const string &dir : dirs)
+        {
+            if (dir.size() > path.size() && starts_with(dir, path) && dir[path.size()] == '/')
+                return true;
+        }
+        return false;
+    }
+
+    // true if the file at path is checked out
+    bool covers_file(const string &path) const
+    {
+        size_t slash = path.rfind('/');
+        return slash == string::npos || enters(path.substr(0, slash));
+    }
+};
+
+// to turn the directories given to checkout into a pattern set; "." (or no
+// directory at all) means everything
+sparse_checkout make_sparse_checkout(const vector<string> &args)
+{
+    sparse_checkout sparse;
+    for (const string &arg : args)
+    {
+        string dir = normalize_path(arg);
+        while (!dir.empty() && dir.back() == '/')
+            dir.pop_back();
+        if (dir.empty() || dir == ".")
+            return sparse_checkout();
+        sparse.dirs.push_back(dir);
+    }
+    sort(sparse.dirs.begin(), sparse.dirs.end());
+    sparse.dirs.erase(unique(sparse.dirs.begin(), sparse.dirs.end()), sparse.dirs.end());
+    return sparse;
+}
+
+// the pattern set of the current checkout, read once per command
+const sparse_checkout &get_sparse_checkout()
+{
+    static const sparse_checkout sparse = []()
+    {
+        vector<string> lines;
+        ifstream ifs(sparse_checkout_path);
+        string line;
+        while (getline(ifs, line))
+        {
+            if (!line.empty() && line[0] != '#')
+                lines.push_back(line);
+        }
+        return make_sparse_checkout(lines);
+    }();
+    return sparse;
+}
+
+// to save the pattern set, an inactive one removes the file
+bool write_sparse_checkout(const sparse_checkout &sparse)
+{
+    if (!sparse.active())
+        return unlink(sparse_checkout_path.c_str()) == 0 || errno == ENOENT;
+    mkdir(".mygit/info", 0755);
+    ofstream ofs(sparse_checkout_path, ios::trunc);
+    for (const string &dir : sparse.dirs)
+        ofs << dir << "\n";
+    if (!ofs)
+    {
+        cerr << "Failed to write " << sparse_checkout_path << endl;
+        return false;
+    }
+    return true;
+}
+
+// a file that checkout has to write once the directories exist
+struct checkout_file
+{
+    string sha;
+    string path;
+    string mode;
+};
+
+// to create the directories of a tree and collect the files to write;
+// subtrees outside the sparse checkout are not read. false if a tree is missing
+bool plan_restore(const string &tree_sha, const string &path, vector<checkout_file> &files,
+                  const sparse_checkout &sparse)
+{
+    vector<tree_entry> entries;
+    if (!read_tree(tree_sha, entries))
+    {
+        cerr << "Tree object not found: " << tree_sha << endl;
+        return false;
+    }
+
+    for (const tree_entry &entry : entries)
+    {
+        string fullPath = path + "/" + entry.filename;
+
+        if (entry.type == "blob")
+        {
+            files.push_back({entry.sha, fullPath, entry.mode});
+        }
+        else if (entry.type == "tree" && sparse.enters(normalize_path(fullPath)))
+        {
+            // create directory and recursively restore tree
+            if (mkdir(fullPath.c_str(), 0755) != 0 && errno != EEXIST)
+                cerr << "Failed to create directory: " << fullPath << endl;
+            if (!plan_restore(entry.sha, fullPath, files, sparse))
+                return false;
+        }
+    }
+    return true;
+}
+
+// to move the worktree from old_tree to new_tree: subtrees with the same SHA are
+// skipped entirely, so only added, modified and removed paths are touched.
+// before is the sparse checkout the worktree has now, after the one it gets;
+// a subtree outside both is never read. false if a tree of new_tree is missing
+bool plan_checkout(const string &old_tree, const string &new_tree, const string &path, vector<checkout_file> &files,
+                   const sparse_checkout &before, const sparse_checkout &after)
+{
+    vector<tree_entry> old_entries, new_entries;
+    if (!read_tree(new_tree, new_entries))
+    {
+        cerr << "Tree object not found: " << new_tree << endl;
+        return false;
+    }
+    if (!read_tree(old_tree, old_entries))
+    {
+        // nothing to compare against, write the whole subtree
+        return plan_restore(new_tree, path, files, after);
+    }
+
+    map<string, const tree_entry *> old_by_name;
+    for (const tree_entry &e : old_entries)
+        old_by_name[e.filename] = &e;
+
+    // a directory is in the worktree if the sparse checkout enters it, a file always
+    auto checked_out = [](const sparse_checkout &sparse, const tree_entry &e, const string &rel)
+    {
+        return e.type != "tree" || sparse.enters(rel);
+    };
+    bool same_patterns = before.dirs == after.dirs;
+
+    for (const tree_entry &entry : new_entries)
+    {
+        string fullPath = path + "/" + entry.filename;
+        string rel = normalize_path(fullPath);
+        const tree_entry *old = nullptr;
+        auto it = old_by_name.find(entry.filename);
+        if (it != old_by_name.end())
+        {
+            old = it->second;
+            old_by_name.erase(it);
+        }
+
+        if (!checked_out(after, entry, rel))
+        {
+            // leaving the sparse checkout, or never in it
+            error_code ec;
+            if (old && checked_out(before, *old, rel))
+                filesystem::remove_all(fullPath, ec);
+            continue;
+        }
+        if (old && !checked_out(before, *old, rel))
+            old = nullptr;
+
+        if (old && old->type == entry.type && old->sha == entry.sha && old->mode == entry.mode &&
+            (same_patterns || (before.includes(rel) && after.includes(rel))))
+            continue;
+
+        if (old && old->type != entry.type)
+        {
+            // a file became a directory or the other way round
+            error_code ec;
+            filesystem::remove_all(fullPath, ec);
+            old = nullptr;
+        }
+
+        if (entry.type == "blob")
+        {
+            files.push_back({entry.sha, fullPath, entry.mode});
+        }
+        else if (entry.type == "tree")
+        {
+            if (mkdir(fullPath.c_str(), 0755) != 0 && errno != EEXIST)
+                cerr << "Failed to create directory: " << fullPath << endl;
+            bool planned = old ? plan_checkout(old->sha, entry.sha, fullPath, files, before, after)
+                               : plan_restore(entry.sha, fullPath, files, after);
+            if (!planned)
+                return false;
+        }
+    }
+
+    // whatever is left only exists in the old tree
+    for (const auto &item : old_by_name)
+    {
+        error_code ec;
+        string fullPath = path + "/" + item.first;
+        if (checked_out(before, *item.second, normalize_path(fullPath)))
+            filesystem::remove_all(fullPath, ec);
+    }
+    return true;
+}
+
+// files handed to one pool task, so small files do not cost a task each
+const size_t checkout_batch = 32;
+
+// to inflate and write the planned files on the thread pool (-j / core.jobs),
+// adding their index paths to written
+bool write_checkout_files(const vector<checkout_file> &files, unordered_set<string> &written)
+{
+    atomic<bool> ok(true);
+    task_group group(get_pool());
+    for (size_t begin = 0; begin < files.size(); begin += checkout_batch)
+    {
+        size_t end = min(files.size(), begin + checkout_batch);
+        group.run([&files, &ok, begin, end]()
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                if (!restore_blob(files[i].sha, files[i].path, files[i].mode))
+                    ok = false;
+            }
+        });
+    }
+    group.wait();
+    for (const checkout_file &f : files)
+        written.insert(normalize_path(f.path));
+    return ok;
+}
+
+// to make the index match a checked out tree: directories whose cache-tree
+// already has the same SHA keep their entries, files the checkout wrote get
+// fresh stat data. any other file whose staged SHA changes keeps its content
+// on disk (a staged edit the checkout did not touch), so it gets no stat data
+// and the next add or diff hashes it again
+void index_from_tree(const string &tree_sha, const string &prefix, cache_tree *old_node, cache_tree &node,
+                     const vector<index_entry> &old_entries, vector<index_entry> &out, const sparse_checkout &sparse,
+                     const unordered_set<string> &written)
+{
+    if (old_node && old_node->entry_count >= 0 && old_node->sha == tree_sha)
+    {
+        auto it = lower_bound(old_entries.begin(), old_entries.end(), prefix,
+                              [](const index_entry &e, const string &key) { return e.path < key; });
+        out.insert(out.end(), it, it + old_node->entry_count);
+        swap(node, *old_node);
+        return;
+    }
+
+    vector<tree_entry> entries;
+    if (!read_tree(tree_sha, entries))
+        return;
+    size_t start = out.size();
+    for (const tree_entry &entry : entries)
+    {
+        string path = prefix + entry.filename;
+        if (entry.type == "tree" && !sparse.enters(path))
+        {
+            // outside the sparse checkout: one entry for the whole directory
+            index_entry e;
+            e.path = path + "/";
+            e.sha = entry.sha;
+            e.mode = S_IFDIR;
+            out.push_back(e);
+            continue;
+        }
+        if (entry.type == "tree")
+        {
+            cache_tree *old_sub = nullptr;
+            if (old_node)
+            {
+                auto it = old_node->subtrees.find(entry.filename);
+                if (it != old_node->subtrees.end())
+                    old_sub = it->second.get();
+            }
+            unique_ptr<cache_tree> sub(new cache_tree);
+            index_from_tree(entry.sha, path + "/", old_sub, *sub, old_entries, out, sparse, written);
+            node.subtrees[entry.filename] = move(sub);
+            continue;
+        }
+
+        index_entry e;
+        auto it = lower_bound(old_entries.begin(), old_entries.end(), path,
+                              [](const index_entry &x, const string &key) { return x.path < key; });
+        struct stat st;
+        if (it != old_entries.end() && it->path == path && it->sha == entry.sha)
+            e = *it;
+        else if (written.count(path) && stat(path.c_str(), &st) == 0)
+        {
+            trace_count(counter_stat);
+            e.path = path;
+            e.sha = entry.sha;
+            fill_stat_data(e, st);
+        }
+        else
+        {
+            e.path = path;
+            e.sha = entry.sha;
+            e.mode = (entry.mode == "100755" || entry.mode == "110755") ? 0100755 : 0100644;
+        }
+        if (is_chunked_mode(entry.mode))
+            mark_chunked(e);
+        out.push_back(e);
+    }
+    node.sha = tree_sha;
+    node.entry_count = out.size() - start;
+}
+
+// to replace the index with the entries of a checked out tree, written being
+// the paths the checkout wrote; when the sparse checkout changes, directories
+// may enter or leave it, so the cached trees of the old index are not reused
+void reset_index(const string &tree_sha, const unordered_set<string> &written,
+                 const sparse_checkout &sparse = get_sparse_checkout())
+{
+    index_state &index = get_index();
+    vector<index_entry> entries;
+    cache_tree tree;
+    bool same_patterns = sparse.dirs == get_sparse_checkout().dirs;
+    index_from_tree(tree_sha, "", same_patterns ? &index.tree : nullptr, tree, index.entries, entries, sparse,
+                    written);
+    sort(entries.begin(), entries.end(), index_entry_less);
+    index.entries.swap(entries);
+    swap(index.tree, tree);
+    index.dirty = true;
+}
+
+// to write a whole tree (what the sparse checkout covers of it) into path;
+// false if a tree is missing or a file could not be written
+bool restore_tree(const string &tree_sha, unordered_set<string> &written, const string &path = ".",
+                  const sparse_checkout &sparse = get_sparse_checkout())
+{
+    vector<checkout_file> files;
+    {
+        trace_scope scope(phase_walk);
+        if (!plan_restore(tree_sha, path, files, sparse))
+            return false;
+    }
+    return write_checkout_files(files, written);
+}
+
+// to write only what differs between old_tree and new_tree into path, while
+// the sparse checkout changes from before to after; false as for restore_tree
+bool checkout_tree(const string &old_tree, const string &new_tree, unordered_set<string> &written,
+                   const string &path = ".", const sparse_checkout &before = get_sparse_checkout(),
+                   const sparse_checkout &after = get_sparse_checkout())
+{
+    vector<checkout_file> files;
+    {
+        trace_scope scope(phase_walk);
+        if (!plan_checkout(old_tree, new_tree, path, files, before, after))
+            return false;
+    }
+    return write_checkout_files(files, written);
+}
+
+// to list the SHA-1 of every loose object under .mygit/objects/xx/
+vector<string> list_loose_objects()
+{
+    vector<string> shas;
+    DIR *objects = opendir(".mygit/objects");
+    if (!objects)
+        return shas;
+
+    struct dirent *entry;
+    while ((entry = readdir(objects)) != nullptr)
+    {
+        string prefix = entry->d_name;
+        if (prefix.size() != 2 || !isxdigit(prefix[0]) || !isxdigit(prefix[1]))
+            continue;
+        DIR *dir = opendir((".mygit/objects/" + prefix).c_str());
+        if (!dir)
+            continue;
+        struct dirent *obj;
+        while ((obj = readdir(dir)) != nullptr)
+        {
+            string rest = obj->d_name;
+            if (rest.size() == SHA_DIGEST_LENGTH * 2 - 2 && all_of(rest.begin(), rest.end(), ::isxdigit))
+                shas.push_back(prefix + rest);
+        }
+        closedir(dir);
+    }
+    closedir(objects);
+    return shas;
+}
+
+// to find the inflated size of a zlib stream without keeping the output
+bool inflated_size(const string &compressed, uint64_t &size)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return false;
+    vector<unsigned char> scratch(stream_chunk_size);
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data()));
+    zs.avail_in = compressed.size();
+    int ret;
+    do
+    {
+        zs.next_out = scratch.data();
+        zs.avail_out = scratch.size();
+        ret = inflate(&zs, Z_NO_FLUSH);
+    } while (ret == Z_OK);
+    size = zs.total_out;
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+// file writer that keeps a running SHA-1 of everything written (pack trailer)
+struct hashing_writer
+{
+    int fd;
+    sha1 ctx;
+    uint64_t offset = 0;
+    bool ok = true;
+
+    explicit hashing_writer(int fd) : fd(fd) {}
+
+    void write_bytes(const void *data, size_t len)
+    {
+        ctx.update(data, len);
+        const char *p = static_cast<const char *>(data);
+        while (ok && len > 0)
+        {
+            ssize_t n = ::write(fd, p, len);
+            if (n <= 0)
+                ok = false;
+            else
+            {
+                p += n;
+                len -= n;
+                offset += n;
+            }
+        }
+    }
+
+    void write_bytes(const string &data) { write_bytes(data.data(), data.size()); }
+
+    // to append the SHA-1 of everything written so far and return it
+    string finish()
+    {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        ctx.final(hash);
+        string checksum(reinterpret_cast<const char *>(hash), SHA_DIGEST_LENGTH);
+        if (::write(fd, hash, SHA_DIGEST_LENGTH) != SHA_DIGEST_LENGTH)
+            ok = false;
+        return checksum;
+    }
+};
+
+// to encode one copy instruction, only the non-zero offset/size bytes are stored
+void put_copy_op(string &out, uint64_t offset, uint64_t size)
+{
+    string args;
+    unsigned char op = 0x80;
+    for (int i = 0; i < 4; ++i)
+    {
+        unsigned char byte = (offset >> (8 * i)) & 0xff;
+        if (byte)
+        {
+            op |= 1 << i;
+            args.push_back(static_cast<char>(byte));
+        }
+    }
+    for (int i = 0; i < 3; ++i)
+    {
+        unsigned char byte = (size >> (8 * i)) & 0xff;
+        if (byte)
+        {
+            op |= 0x10 << i;
+            args.push_back(static_cast<char>(byte));
+        }
+    }
+    out.push_back(static_cast<char>(op));
+    out += args;
+}
+
+void flush_insert(string &out, const string &target, size_t start, size_t end)
+{
+    while (start < end)
+    {
+        size_t n = min<size_t>(127, end - start);
+        out.push_back(static_cast<char>(n));
+        out.append(target, start, n);
+        start += n;
+    }
+}
+
+// to build a delta that turns base into target (see apply_delta for the format):
+// every 16-byte block of the base is indexed by a hash, the target is scanned
+// with a rolling hash of the same width and matches are extended as far as they go;
+// returns an empty string if the delta would not be smaller than max_size
+string create_delta(const string &base, const string &target, size_t max_size)
+{
+    const size_t block = 16;
+    const uint32_t mult = 0x01000193;
+    if (base.size() < block || target.size() < block || base.size() > 0xffffffffu)
+        return "";
+
+    auto block_hash = [&](const string &data, size_t pos)
+    {
+        uint32_t h = 0;
+        for (size_t k = 0; k < block; ++k)
+            h = h * mult + static_cast<unsigned char>(data[pos + k]);
+        return h;
+    };
+    // mult^(block - 1), to drop the outgoing byte when rolling
+    uint32_t drop = 1;
+    for (size_t k = 1; k < block; ++k)
+        drop *= mult;
+
+    unordered_map<uint32_t, vector<uint32_t>> blocks;
+    blocks.reserve(base.size() / block);
+    for (size_t i = 0; i + block <= base.size(); i += block)
+    {
+        vector<uint32_t> &bucket = blocks[block_hash(base, i)];
+        if (bucket.size() < 8)
+            bucket.push_back(i);
+    }
+
+    string out;
+    put_varint(out, base.size());
+    put_varint(out, target.size());
+
+    size_t insert_start = 0;
+    size_t i = 0;
+    uint32_t h = block_hash(target, 0);
+    while (i + block <= target.size())
+    {
+        size_t best_len = 0, best_off = 0;
+        auto it = blocks.find(h);
+        if (it != blocks.end())
+        {
+            for (uint32_t off : it->second)
+            {
+                size_t len = 0;
+                while (off + len < base.size() && i + len < target.size() && base[off + len] == target[i + len])
+                    ++len;
+                if (len > best_len)
+                {
+                    best_len = len;
+                    best_off = off;
+                }
+            }
+        }
+
+        if (best_len < block)
+        {
+            // no usable match, this byte becomes a literal
+            if (i + block < target.size())
+                h = (h - drop * static_cast<unsigned char>(target[i])) * mult + static_cast<unsigned char>(target[i + block]);
+            ++i;
+            continue;
+        }
+
+        // grow the match backwards over bytes that were going to be inserted
+        size_t start = i;
+        while (start > insert_start && best_off > 0 && base[best_off - 1] == target[start - 1])
+        {
+            --start;
+            --best_off;
+            ++best_len;
+        }
+
+        flush_insert(out, target, insert_start, start);
+        for (size_t done = 0; done < best_len;)
+        {
+            size_t n = min<size_t>(best_len - done, 0xffffff);
+            put_copy_op(out, best_off + done, n);
+            done += n;
+        }
+        if (out.size() >= max_size)
+            return "";
+
+        i = start + best_len;
+        insert_start = i;
+        if (i + block <= target.size())
+            h = block_hash(target, i);
+    }
+    flush_insert(out, target, insert_start, target.size());
+
+    if (out.size() >= max_size)
+        return "";
+    return out;
+}
+
+// what repack knows about an object when it chooses delta bases
+struct pack_candidate
+{
+    string sha;
+    // 0 = commit, 1 = tree, 2 = blob, 3 = unknown
+    int type_rank = 3;
+    // file name the object was last seen under, similar names delta well
+    string name;
+    uint64_t size = 0;
+};
+
+// to record the type and file name of everything reachable from HEAD so the
+// delta search only compares objects of the same kind
+void collect_pack_hints(unordered_map<string, pack_candidate> &hints)
+{
+    ifstream head_file(".mygit/HEAD");
+    string commit_sha;
+    if (head_file)
+        getline(head_file, commit_sha);
+
+    vector<pair<string, string>> trees;
+    while (!commit_sha.empty() && !hints.count(commit_sha))
+    {
+        shared_ptr<const stored_object> commit = get_object_store().read(commit_sha, "commit");
+        if (!commit)
+            break;
+        hints[commit_sha].type_rank = 0;
+
+        istringstream iss(commit->content);
+        string line, parent;
+        while (getline(iss, line) && !line.empty())
+        {
+            if (starts_with(line, "tree "))
+                trees.push_back({line.substr(5), ""});
+            else if (starts_with(line, "parent "))
+                parent = line.substr(7);
+        }
+        commit_sha = parent;
+    }
+
+    while (!trees.empty())
+    {
+        auto tree = trees.back();
+        trees.pop_back();
+        if (hints.count(tree.first))
+            continue;
+        pack_candidate &hint = hints[tree.first];
+        hint.type_rank = 1;
+        hint.name = tree.second;
+
+        vector<tree_entry> entries;
+        if (!read_tree(tree.first, entries))
+            continue;
+        for (const tree_entry &entry : entries)
+        {
+            if (entry.type == "tree")
+            {
+                trees.push_back({entry.sha, entry.filename});
+            }
+            else if (entry.type == "blob" && !hints.count(entry.sha))
+            {
+                hints[entry.sha].type_rank = 2;
+                hints[entry.sha].name = entry.filename;
+            }
+        }
+    }
+}
+
+// to write the index of a finished temp packfile (offsets: SHA-1 and offset of
+// every object) and rename both into place as pack-<checksum>; base is set to
+// the installed path without its extension
+bool install_pack(const string &tmp_pack, vector<pair<string, uint64_t>> &offsets, const string &pack_checksum, string &base)
+{
+    // index: fanout table, sorted SHA-1s, offsets, checksums
+    sort(offsets.begin(), offsets.end());
+    string idx(idx_magic, 4);
+    put_be32(idx, 1);
+    uint32_t fanout[256] = {0};
+    for (const auto &item : offsets)
+        ++fanout[stoi(item.first.substr(0, 2), nullptr, 16)];
+    for (int i = 1; i < 256; ++i)
+        fanout[i] += fanout[i - 1];
+    for (int i = 0; i < 256; ++i)
+        put_be32(idx, fanout[i]);
+    for (const auto &item : offsets)
+        idx += hex_to_bin(item.first);
+    for (const auto &item : offsets)
+        put_be64(idx, item.second);
+    idx += pack_checksum;
+    unsigned char idx_hash[SHA_DIGEST_LENGTH];
+    sha1_buffer(idx.data(), idx.size(), idx_hash);
+    idx.append(reinterpret_cast<const char *>(idx_hash), SHA_DIGEST_LENGTH);
+
+    string name = bin_to_hex(reinterpret_cast<const unsigned char *>(pack_checksum.data()), SHA_DIGEST_LENGTH);
+    base = ".mygit/objects/pack/pack-" + name;
+    string tmp_idx = base + ".idx.tmp";
+    {
+        ofstream ofs(tmp_idx, ios::binary | ios::trunc);
+        ofs.write(idx.data(), idx.size());
+        if (!ofs)
+        {
+            cerr << "Failed to write pack index." << endl;
+            unlink(tmp_pack.c_str());
+            unlink(tmp_idx.c_str());
+            return false;
+        }
+    }
+    // the pack goes first so a reader never sees an index without its pack
+    chmod(tmp_pack.c_str(), 0444);
+    chmod(tmp_idx.c_str(), 0444);
+    if (rename(tmp_pack.c_str(), (base + ".pack").c_str()) != 0 ||
+        rename(tmp_idx.c_str(), (base + ".idx").c_str()) != 0)
+    {
+        cerr << "Failed to install packfile: " << base << ".pack" << endl;
+        unlink(tmp_pack.c_str());
+        unlink(tmp_idx.c_str());
+        return false;
+    }
+    return true;
+}
+
+// objects bigger than this are stored whole and never kept in the delta window
+const uint64_t delta_size_limit = 64 << 20;
+
+// to deflate data into a pack entry, false if zlib fails
+bool deflate_entry(const string &data, string &compressed)
+{
+    uLongf compressed_size = compressBound(data.size());
+    compressed.assign(compressed_size, '\0');
+    if (compress(reinterpret_cast<Bytef *>(&compressed[0]), &compressed_size,
+                 reinterpret_cast<const Bytef *>(data.data()), data.size()) != Z_OK)
+        return false;
+    compressed.resize(compressed_size);
+    return true;
+}
+
+// to pack every loose object and the objects of older packs into one new
+// packfile plus index, then remove the loose copies and the old packs;
+// objects are sorted by type, name and size and each one is tried as a delta
+// against the previous pack.window objects, keeping chains under pack.depth
+int repack()
+{
+    mkdir(".mygit/objects/pack", 0755);
+
+    int window = atoi(get_config("pack.window", "10").c_str());
+    int max_depth = atoi(get_config("pack.depth", "50").c_str());
+
+    vector<string> loose = list_loose_objects();
+    vector<string> shas = loose;
+    for (const pack_file &pack : get_packs())
+    {
+        for (uint32_t i = 0; i < pack.count; ++i)
+            shas.push_back(bin_to_hex(pack.oids() + (size_t)i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+    }
+    sort(shas.begin(), shas.end());
+    shas.erase(unique(shas.begin(), shas.end()), shas.end());
+
+    if (shas.empty())
+    {
+        cout << "Nothing to pack." << endl;
+        return 0;
+    }
+
+    unordered_map<string, pack_candidate> hints;
+    collect_pack_hints(hints);
+
+    vector<pack_candidate> objects;
+    objects.reserve(shas.size());
+    for (const string &sha : shas)
+    {
+        pack_candidate c;
+        auto hint = hints.find(sha);
+        string type_name;
+        uint64_t header_size;
+        if (hint != hints.end())
+            c = hint->second;
+        else if (read_object_header(sha, type_name, header_size))
+            c.type_rank = (type_name == "commit") ? 0 : (type_name == "tree") ? 1 : 2;
+        c.sha = sha;
+
+        // the size is in a whole pack entry or the loose zlib stream, deltas have to be inflated
+        const pack_file *pack;
+        uint64_t offset, data_size;
+        unsigned char type;
+        const unsigned char *data;
+        bool sized;
+        if (find_packed_object(sha, pack, offset))
+            sized = pack_entry_at(*pack, offset, type, c.size, data, data_size) && type == pack_obj_full;
+        else
+            sized = inflated_size(read_file(loose_object_path(sha)), c.size);
+
+        string content;
+        if (!sized && !read_raw_object(sha, content))
+        {
+            cerr << "Corrupt object: " << sha << endl;
+            return -1;
+        }
+        if (!sized)
+            c.size = content.size();
+        objects.push_back(c);
+    }
+
+    // similar objects end up next to each other, bigger ones first so they become the bases
+    stable_sort(objects.begin(), objects.end(), [](const pack_candidate &a, const pack_candidate &b)
+    {
+        if (a.type_rank != b.type_rank)
+            return a.type_rank < b.type_rank;
+        if (a.name != b.name)
+            return a.name < b.name;
+        return a.size > b.size;
+    });
+
+    string tmp_pack = ".mygit/objects/pack/tmp_pack_XXXXXX";
+    int fd = mkstemp(&tmp_pack[0]);
+    if (fd < 0)
+    {
+        cerr << "Failed to create temporary packfile." << endl;
+        return -1;
+    }
+
+    hashing_writer pack_out(fd);
+    string header = "PACK";
+    put_be32(header, pack_version);
+    put_be32(header, objects.size());
+    pack_out.write_bytes(header);
+
+    struct window_slot
+    {
+        size_t index;
+        uint64_t offset;
+        int depth;
+        string content;
+    };
+    deque<window_slot> slots;
+    vector<pair<string, uint64_t>> offsets;
+    offsets.reserve(objects.size());
+    size_t delta_count = 0;
+
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+        const pack_candidate &obj = objects[i];
+        string content;
+        bool windowed = obj.size <= delta_size_limit && window > 0;
+        if (windowed && !read_raw_object(obj.sha, content))
+        {
+            cerr << "Corrupt object: " << obj.sha << endl;
+            close(fd);
+            unlink(tmp_pack.c_str());
+            return -1;
+        }
+
+        // pick the smallest delta against an object of the same kind in the window
+        string best_delta;
+        const window_slot *best_base = nullptr;
+        if (windowed)
+        {
+            for (const window_slot &slot : slots)
+            {
+                const pack_candidate &base = objects[slot.index];
+                if (base.type_rank != obj.type_rank || slot.depth >= max_depth)
+                    continue;
+                size_t limit = best_base ? best_delta.size() : content.size() / 2;
+                string delta = create_delta(slot.content, content, limit);
+                if (!delta.empty())
+                {
+                    best_delta.swap(delta);
+                    best_base = &slot;
+                }
+            }
+        }
+
+        uint64_t entry_offset = pack_out.offset;
+        string entry_header;
+        string compressed;
+        int depth = 0;
+        bool deflated = true;
+        if (best_base)
+        {
+            deflated = deflate_entry(best_delta, compressed);
+            entry_header.push_back(static_cast<char>(pack_obj_ofs_delta));
+            put_varint(entry_header, entry_offset - best_base->offset);
+            put_varint(entry_header, best_delta.size());
+            depth = best_base->depth + 1;
+            ++delta_count;
+        }
+        else
+        {
+            // reuse the zlib stream of a loose object or whole packed object when there is one
+            const pack_file *pack;
+            uint64_t offset, size, data_size;
+            unsigned char type;
+            const unsigned char *data;
+            if (find_packed_object(obj.sha, pack, offset) && pack_entry_at(*pack, offset, type, size, data, data_size) &&
+                type == pack_obj_full)
+            {
+                compressed.assign(reinterpret_cast<const char *>(data), data_size);
+            }
+            else if (!find_packed_object(obj.sha, pack, offset))
+            {
+                compressed = read_file(loose_object_path(obj.sha));
+            }
+            else
+            {
+                deflated = (windowed || read_raw_object(obj.sha, content)) && deflate_entry(content, compressed);
+            }
+            entry_header.push_back(static_cast<char>(pack_obj_full));
+            put_varint(entry_header, obj.size);
+        }
+        if (!deflated)
+        {
+            cerr << "Failed to compress object: " << obj.sha << endl;
+            close(fd);
+            unlink(tmp_pack.c_str());
+            return -1;
+        }
+        put_varint(entry_header, compressed.size());
+        pack_out.write_bytes(entry_header);
+        pack_out.write_bytes(compressed);
+        offsets.push_back({obj.sha, entry_offset});
+
+        if (windowed)
+        {
+            slots.push_back({i, entry_offset, depth, move(content)});
+            if ((int)slots.size() > window)
+                slots.pop_front();
+        }
+    }
+    string pack_checksum = pack_out.finish();
+    if (!pack_out.ok || fsync(fd) != 0 || close(fd) != 0)
+    {
+        cerr << "Failed to write packfile." << endl;
+        unlink(tmp_pack.c_str());
+        return -1;
+    }
+
+    string base;
+    if (!install_pack(tmp_pack, offsets, pack_checksum, base))
+        return -1;
+
+    // everything is in the new pack now, drop the old packs and loose objects
+    for (const pack_file &pack : get_packs())
+    {
+        if (pack.pack_path == base + ".pack")
+            continue;
+        string old_base = pack.pack_path.substr(0, pack.pack_path.size() - 5);
+        unlink((old_base + ".idx").c_str());
+        unlink(pack.pack_path.c_str());
+    }
+    for (const string &sha : loose)
+        unlink(loose_object_path(sha).c_str());
+    for (int i = 0; i < 256; ++i)
+    {
+        char prefix[3];
+        snprintf(prefix, sizeof(prefix), "%02x", i);
+        rmdir((string(".mygit/objects/") + prefix).c_str());
+    }
+
+    cout << "Packed " << objects.size() << " objects (" << delta_count << " deltas) into " << base << ".pack" << endl;
+    return 0;
+}
+
+// the commit-graph (.mygit/objects/info/commit-graph) lets history walks
+// follow parents without inflating and parsing commit objects
+//
+//   "CGPH", version, chunk count, chunk table (4-byte id + 64-bit offset, a
+//   zero id marks where the last chunk ends), the chunks, then a SHA-1 of
+//   everything before it
+//   OIDF : 256-entry fanout table, as in the pack index
+//   OIDL : sorted binary commit SHA-1s
+//   CDAT : one fixed-width row per commit, in OIDL order: tree SHA-1, position
+//          of the parent (graph_no_parent for a root commit), generation number
+//          (root commits are 1, every other commit is its parent's + 1) and the
+//          64-bit commit time
+//   BIDX : for each commit, in OIDL order, the end offset of its filter in BDAT
+//   BDAT : hash version, number of hashes and bits per path (32 bits each),
+//          then the changed-path Bloom filters one after the other
+// every parent of a commit in the graph is in the graph too; graphs written
+// before the Bloom filters existed have no BIDX/BDAT and are still read
+const string commit_graph_path = ".mygit/objects/info/commit-graph";
+const uint32_t commit_graph_version = 1;
+const uint32_t graph_no_parent = 0xffffffff;
+const size_t graph_row_size = SHA_DIGEST_LENGTH + 4 + 4 + 8;
+
+// changed-path Bloom filters, the same parameters as git: every path a commit
+// changes compared to its parent (and every directory above it) is added with
+// bloom_hashes bit positions from two murmur3 hashes; a commit that changes
+// more than bloom_max_paths paths gets a single all-ones byte, which matches
+// any path, and a commit that changes nothing gets an empty filter
+const uint32_t bloom_hash_version = 1;
+const uint32_t bloom_hashes = 7;
+const uint32_t bloom_bits_per_path = 10;
+const size_t bloom_max_paths = 512;
+const size_t bloom_header_size = 12;
+
+uint32_t murmur3_32(uint32_t seed, const string &data)
+{
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    size_t len = data.size();
+    const unsigned char *p = reinterpret_cast<const unsigned char *>(data.data());
+    uint32_t h = seed;
+    size_t blocks = len / 4;
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        uint32_t k = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16) | ((uint32_t)p[i * 4 + 3] << 24);
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        h ^= k;
+        h = (h << 13) | (h >> 19);
+        h = h * 5 + 0xe6546b64;
+    }
+    const unsigned char *tail = p + blocks * 4;
+    uint32_t k = 0;
+    switch (len & 3)
+    {
+    case 3:
+        k ^= tail[2] << 16;
+        // fall through
+    case 2:
+        k ^= tail[1] << 8;
+        // fall through
+    case 1:
+        k ^= tail[0];
+        k *= c1;
+        k = (k << 15) | (k >> 17);
+        k *= c2;
+        h ^= k;
+    }
+    h ^= len;
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+// to get the bit positions of a path in a filter of filter_bits bits
+void bloom_positions(const string &path, uint64_t filter_bits, uint64_t positions[bloom_hashes])
+{
+    uint32_t h1 = murmur3_32(0x293ae76f, path);
+    uint32_t h2 = murmur3_32(0x7e646e2c, path);
+    for (uint32_t i = 0; i < bloom_hashes; ++i)
+        positions[i] = (h1 + i * h2) % filter_bits;
+}
+
+// to build the filter of a commit from the paths it changed
+string bloom_filter(const vector<string> &paths)
+{
+    if (paths.size() > bloom_max_paths)
+        return string(1, '\xff');
+    string filter((paths.size() * bloom_bits_per_path + 7) / 8, '\0');
+    for (const string &path : paths)
+    {
+        uint64_t positions[bloom_hashes];
+        bloom_positions(path, filter.size() * 8, positions);
+        for (uint64_t bit : positions)
+            filter[bit / 8] |= 1 << (bit % 8);
+    }
+    return filter;
+}
+
+// false means the commit certainly did not change path, true that it might have
+bool bloom_maybe_contains(const unsigned char *filter, size_t len, const string &path)
+{
+    if (len == 0)
+        return false;
+    uint64_t positions[bloom_hashes];
+    bloom_positions(path, (uint64_t)len * 8, positions);
+    for (uint64_t bit : positions)
+    {
+        if (!(filter[bit / 8] & (1 << (bit % 8))))
+            return false;
+    }
+    return true;
+}
+
+struct commit_graph
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    const unsigned char *fanout = nullptr;
+    const unsigned char *oids = nullptr;
+    const unsigned char *rows = nullptr;
+    const unsigned char *bloom_index = nullptr;
+    const unsigned char *bloom_data = nullptr;
+    uint64_t bloom_data_size = 0;
+    uint32_t count = 0;
+
+    // to find the position of a commit: fanout table, then binary search
+    bool find(const string &sha, uint32_t &pos) const
+    {
+        if (!data || sha.size() != SHA_DIGEST_LENGTH * 2)
+            return false;
+        string bin = hex_to_bin(sha);
+        const unsigned char *key = reinterpret_cast<const unsigned char *>(bin.data());
+        uint32_t lo = key[0] == 0 ? 0 : get_be32(fanout + (key[0] - 1) * 4);
+        uint32_t hi = get_be32(fanout + key[0] * 4);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(oids + (size_t)mid * SHA_DIGEST_LENGTH, key, SHA_DIGEST_LENGTH);
+            if (cmp == 0)
+            {
+                pos = mid;
+                return true;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return false;
+    }
+
+    string oid(uint32_t pos) const { return bin_to_hex(oids + (size_t)pos * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH); }
+    string tree(uint32_t pos) const { return bin_to_hex(row(pos), SHA_DIGEST_LENGTH); }
+    uint32_t parent(uint32_t pos) const { return get_be32(row(pos) + SHA_DIGEST_LENGTH); }
+    uint32_t generation(uint32_t pos) const { return get_be32(row(pos) + SHA_DIGEST_LENGTH + 4); }
+    int64_t commit_time(uint32_t pos) const { return (int64_t)get_be64(row(pos) + SHA_DIGEST_LENGTH + 8); }
+
+    // to find the changed-path filter of a commit, false if the graph has none
+    bool bloom(uint32_t pos, const unsigned char *&filter, size_t &len) const
+    {
+        if (!bloom_index)
+            return false;
+        uint64_t start = pos == 0 ? 0 : get_be32(bloom_index + (size_t)(pos - 1) * 4);
+        uint64_t end = get_be32(bloom_index + (size_t)pos * 4);
+        if (end < start || bloom_header_size + end > bloom_data_size)
+            return false;
+        filter = bloom_data + bloom_header_size + start;
+        len = end - start;
+        return true;
+    }
+
+private:
+    const unsigned char *row(uint32_t pos) const { return rows + (size_t)pos * graph_row_size; }
+};
+
+// to mmap the commit-graph, an empty graph if there is none or it is unusable
+commit_graph load_commit_graph()
+{
+    commit_graph graph;
+    size_t size = 0;
+    const unsigned char *data = map_file(commit_graph_path, size);
+    if (!data)
+        return graph;
+
+    const unsigned char *oidf = nullptr, *oidl = nullptr, *cdat = nullptr, *bidx = nullptr, *bdat = nullptr;
+    uint64_t oidl_size = 0, cdat_size = 0, bidx_size = 0, bdat_size = 0;
+    bool ok = size >= 12 + 12 + SHA_DIGEST_LENGTH && memcmp(data, "CGPH", 4) == 0 &&
+              get_be32(data + 4) == commit_graph_version;
+    if (ok)
+    {
+        uint32_t chunks = get_be32(data + 8);
+        uint64_t table_end = 12 + ((uint64_t)chunks + 1) * 12;
+        uint64_t limit = size - SHA_DIGEST_LENGTH;
+        ok = table_end <= limit;
+        for (uint32_t i = 0; ok && i < chunks; ++i)
+        {
+            const unsigned char *entry = data + 12 + (size_t)i * 12;
+            uint64_t start = get_be64(entry + 4);
+            uint64_t end = get_be64(entry + 16);
+            if (start < table_end || end < start || end > limit)
+            {
+                ok = false;
+                break;
+            }
+            if (memcmp(entry, "OIDF", 4) == 0 && end - start == 256 * 4)
+                oidf = data + start;
+            else if (memcmp(entry, "OIDL", 4) == 0)
+            {
+                oidl = data + start;
+                oidl_size = end - start;
+            }
+            else if (memcmp(entry, "CDAT", 4) == 0)
+            {
+                cdat = data + start;
+                cdat_size = end - start;
+            }
+            else if (memcmp(entry, "BIDX", 4) == 0)
+            {
+                bidx = data + start;
+                bidx_size = end - start;
+            }
+            else if (memcmp(entry, "BDAT", 4) == 0)
+            {
+                bdat = data + start;
+                bdat_size = end - start;
+            }
+        }
+    }
+    if (ok && oidf && oidl && cdat)
+    {
+        uint32_t count = get_be32(oidf + 255 * 4);
+        ok = oidl_size == (uint64_t)count * SHA_DIGEST_LENGTH && cdat_size == (uint64_t)count * graph_row_size;
+        if (ok)
+        {
+            graph.data = data;
+            graph.size = size;
+            graph.fanout = oidf;
+            graph.oids = oidl;
+            graph.rows = cdat;
+            graph.count = count;
+            // filters with other parameters cannot be checked, the graph works without them
+            if (bidx && bdat && bidx_size == (uint64_t)count * 4 && bdat_size >= bloom_header_size &&
+                get_be32(bdat) == bloom_hash_version && get_be32(bdat + 4) == bloom_hashes &&
+                get_be32(bdat + 8) == bloom_bits_per_path)
+            {
+                graph.bloom_index = bidx;
+                graph.bloom_data = bdat;
+                graph.bloom_data_size = bdat_size;
+            }
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t parent = graph.parent(i);
+                if (parent != graph_no_parent && parent >= count)
+                {
+                    ok = false;
+                    break;
+                }
+            }
+        }
+    }
+    else
+        ok = false;
+
+    if (!ok)
+    {
+        cerr << "Ignoring invalid commit-graph: " << commit_graph_path << endl;
+        munmap(const_cast<unsigned char *>(data), size);
+        return commit_graph();
+    }
+    return graph;
+}
+
+commit_graph &get_commit_graph()
+{
+    static commit_graph graph = load_commit_graph();
+    return graph;
+}
+
+// a commit as it goes into the commit-graph
+struct graph_commit
+{
+    string sha;
+    string tree;
+    string parent;
+    int64_t time;
+    // changed-path filter, computed when the graph is written if has_bloom is not set
+    string bloom;
+    bool has_bloom = false;
+};
+
+// to list the paths that differ between two trees (either can be empty for a
+// tree that does not exist), directories included; subtrees with the same SHA
+// are not read, and the walk stops once more than limit paths were found
+void collect_changed_paths(const string &old_tree, const string &new_tree, const string &prefix,
+                           vector<string> &paths, size_t limit)
+{
+    if (old_tree == new_tree || paths.size() > limit)
+        return;
+    vector<tree_entry> old_entries, new_entries;
+    if (!old_tree.empty())
+        read_tree(old_tree, old_entries);
+    if (!new_tree.empty())
+        read_tree(new_tree, new_entries);
+
+    // both lists are in tree order, so they are merged in one pass; a file and
+    // a directory of the same name do not pair up and show as a removal and an addition
+    size_t i = 0, j = 0;
+    while ((i < old_entries.size() || j < new_entries.size()) && paths.size() <= limit)
+    {
+        const tree_entry *a = nullptr, *b = nullptr;
+        if (j == new_entries.size() || (i < old_entries.size() && tree_entry_less(old_entries[i], new_entries[j])))
+            a = &old_entries[i++];
+        else if (i == old_entries.size() || tree_entry_less(new_entries[j], old_entries[i]))
+            b = &new_entries[j++];
+        else
+        {
+            a = &old_entries[i++];
+            b = &new_entries[j++];
+        }
+        if (a && b && a->sha == b->sha && a->mode == b->mode)
+            continue;
+
+        string path = prefix + (a ? a->filename : b->filename);
+        paths.push_back(path);
+        string old_sub = a && a->type == "tree" ? a->sha : "";
+        string new_sub = b && b->type == "tree" ? b->sha : "";
+        if (!old_sub.empty() || !new_sub.empty())
+            collect_changed_paths(old_sub, new_sub, path + "/", paths, limit);
+    }
+}
+
+// to read the tree, parent and time of a commit object; the time is parsed
+// back from the ctime() string on the author line
+bool parse_commit(const string &sha, graph_commit &c)
+{
+    shared_ptr<const stored_object> commit = get_object_store().read(sha, "commit");
+    if (!commit)
+        return false;
+
+    c = {sha, "", "", 0};
+    istringstream iss(commit->content);
+    string line;
+    while (getline(iss, line) && !line.empty())
+    {
+        if (starts_with(line, "tree "))
+            c.tree = line.substr(5);
+        else if (starts_with(line, "parent "))
+            c.parent = line.substr(7);
+        else if (starts_with(line, "author ") && line.size() >= 7 + 24)
+        {
+            struct tm tm = {};
+            if (strptime(line.c_str() + line.size() - 24, "%a %b %d %H:%M:%S %Y", &tm))
+            {
+                tm.tm_isdst = -1;
+                c.time = mktime(&tm);
+            }
+        }
+    }
+    return true;
+}
+
+// to tell whether path differs between two trees (either can be empty); the
+// walk down the path stops at the first directory with the same SHA on both sides
+bool path_changed(string old_tree, string new_tree, const string &path)
+{
+    size_t start = 0;
+    while (old_tree != new_tree)
+    {
+        size_t slash = path.find('/', start);
+        string name = path.substr(start, slash == string::npos ? string::npos : slash - start);
+        vector<tree_entry> old_entries, new_entries;
+        if (!old_tree.empty())
+            read_tree(old_tree, old_entries);
+        if (!new_tree.empty())
+            read_tree(new_tree, new_entries);
+        const tree_entry *a = find_tree_entry(old_entries, name);
+        const tree_entry *b = find_tree_entry(new_entries, name);
+        if (slash == string::npos)
+            return (a || b) && !(a && b && a->type == b->type && a->sha == b->sha && a->mode == b->mode);
+        old_tree = a && a->type == "tree" ? a->sha : "";
+        new_tree = b && b->type == "tree" ? b->sha : "";
+        start = slash + 1;
+    }
+    return false;
+}
+
+// to write the commit-graph for the given commits, every parent must be among them
+bool write_commit_graph(vector<graph_commit> &commits)
+{
+    sort(commits.begin(), commits.end(), [](const graph_commit &a, const graph_commit &b)
+    {
+        return a.sha < b.sha;
+    });
+    commits.erase(unique(commits.begin(), commits.end(), [](const graph_commit &a, const graph_commit &b)
+    {
+        return a.sha == b.sha;
+    }), commits.end());
+
+    const uint32_t count = commits.size();
+    vector<uint32_t> parents(count, graph_no_parent);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (commits[i].parent.empty())
+            continue;
+        auto it = lower_bound(commits.begin(), commits.end(), commits[i].parent,
+                              [](const graph_commit &c, const string &sha) { return c.sha < sha; });
+        if (it == commits.end() || it->sha != commits[i].parent)
+        {
+            cerr << "Commit-graph is missing parent " << commits[i].parent << " of " << commits[i].sha << endl;
+            return false;
+        }
+        parents[i] = it - commits.begin();
+    }
+
+    // generation numbers: walk down each chain until a known generation, then fill it in on the way back
+    vector<uint32_t> generations(count, 0);
+    vector<uint32_t> chain;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        uint32_t pos = i;
+        while (pos != graph_no_parent && generations[pos] == 0)
+        {
+            chain.push_back(pos);
+            if (chain.size() > count)
+            {
+                cerr << "Commit history has a cycle at " << commits[pos].sha << endl;
+                return false;
+            }
+            pos = parents[pos];
+        }
+        uint32_t generation = pos == graph_no_parent ? 0 : generations[pos];
+        while (!chain.empty())
+        {
+            generations[chain.back()] = ++generation;
+            chain.pop_back();
+        }
+    }
+
+    // filters of new commits: their tree against their parent's, on the pool
+    {
+        task_group group(get_pool());
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            if (commits[i].has_bloom)
+                continue;
+            graph_commit *c = &commits[i];
+            string parent_tree = parents[i] == graph_no_parent ? "" : commits[parents[i]].tree;
+            group.run([c, parent_tree]()
+            {
+                vector<string> paths;
+                collect_changed_paths(parent_tree, c->tree, "", paths, bloom_max_paths);
+                c->bloom = bloom_filter(paths);
+                c->has_bloom = true;
+            });
+        }
+        group.wait();
+    }
+    uint64_t bloom_size = 0;
+    for (const graph_commit &c : commits)
+        bloom_size += c.bloom.size();
+    if (bloom_size > 0xffffffffULL)
+    {
+        cerr << "Changed-path filters are too large for the commit-graph." << endl;
+        return false;
+    }
+
+    const uint32_t chunks = 5;
+    uint64_t offset = 12 + (chunks + 1) * 12;
+    string out = "CGPH";
+    put_be32(out, commit_graph_version);
+    put_be32(out, chunks);
+    const pair<const char *, uint64_t> table[chunks] = {
+        {"OIDF", 256 * 4},
+        {"OIDL", (uint64_t)count * SHA_DIGEST_LENGTH},
+        {"CDAT", (uint64_t)count * graph_row_size},
+        {"BIDX", (uint64_t)count * 4},
+        {"BDAT", bloom_header_size + bloom_size}};
+    for (const auto &chunk : table)
+    {
+        out.append(chunk.first, 4);
+        put_be64(out, offset);
+        offset += chunk.second;
+    }
+    out.append(4, '\0');
+    put_be64(out, offset);
+
+    uint32_t fanout[256] = {0};
+    for (const graph_commit &c : commits)
+        ++fanout[stoi(c.sha.substr(0, 2), nullptr, 16)];
+    for (int i = 1; i < 256; ++i)
+        fanout[i] += fanout[i - 1];
+    for (int i = 0; i < 256; ++i)
+        put_be32(out, fanout[i]);
+    for (const graph_commit &c : commits)
+        out += hex_to_bin(c.sha);
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        out += hex_to_bin(commits[i].tree);
+        put_be32(out, parents[i]);
+        put_be32(out, generations[i]);
+        put_be64(out, (uint64_t)commits[i].time);
+    }
+    uint32_t bloom_end = 0;
+    for (const graph_commit &c : commits)
+    {
+        bloom_end += c.bloom.size();
+        put_be32(out, bloom_end);
+    }
+    put_be32(out, bloom_hash_version);
+    put_be32(out, bloom_hashes);
+    put_be32(out, bloom_bits_per_path);
+    for (const graph_commit &c : commits)
+        out += c.bloom;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    sha1_buffer(out.data(), out.size(), hash);
+    out.append(reinterpret_cast<const char *>(hash), SHA_DIGEST_LENGTH);
+
+    mkdir(".mygit/objects/info", 0755);
+    string tmp_path = commit_graph_path + ".tmp";
+    {
+        ofstream ofs(tmp_path, ios::binary | ios::trunc);
+        ofs.write(out.data(), out.size());
+        if (!ofs)
+        {
+            cerr << "Failed to write commit-graph." << endl;
+            unlink(tmp_path.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp_path.c_str(), commit_graph_path.c_str()) != 0)
+    {
+        cerr << "Failed to install commit-graph." << endl;
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// to bring the commit-graph up to date with HEAD: the commits already in the
+// graph are kept, and only commits above them are read from the object store
+int update_commit_graph(bool verbose)
+{
+    string head = read_file_if_exists(".mygit/HEAD");
+    while (!head.empty() && isspace(static_cast<unsigned char>(head.back())))
+        head.pop_back();
+
+    commit_graph &graph = get_commit_graph();
+    vector<graph_commit> commits;
+    commits.reserve(graph.count + 1);
+    for (uint32_t i = 0; i < graph.count; ++i)
+    {
+        uint32_t parent = graph.parent(i);
+        commits.push_back({graph.oid(i), graph.tree(i), parent == graph_no_parent ? "" : graph.oid(parent),
+                           graph.commit_time(i)});
+        const unsigned char *filter;
+        size_t len;
+        if (graph.bloom(i, filter, len))
+        {
+            commits.back().bloom.assign(reinterpret_cast<const char *>(filter), len);
+            commits.back().has_bloom = true;
+        }
+    }
+
+    size_t added = 0;
+    uint32_t pos;
+    for (string sha = head; !sha.empty() && !graph.find(sha, pos);)
+    {
+        graph_commit c;
+        if (!parse_commit(sha, c))
+        {
+            cerr << "Commit not found: " << sha << endl;
+            return -1;
+        }
+        commits.push_back(c);
+        ++added;
+        sha = c.parent;
+    }
+
+    // a graph from before the changed-path filters gets them for every commit
+    if (added > 0 || !graph.data || !graph.bloom_index)
+    {
+        if (!write_commit_graph(commits))
+            return -1;
+    }
+    if (verbose)
+        cout << "Wrote commit-graph with " << commits.size() << " commits (" << added << " new)." << endl;
+    return 0;
+}
+
+// to find the parent of a commit without the commit-graph, false if the commit is missing
+bool read_commit_parent(const string &sha, string &parent)
+{
+    graph_commit c;
+    if (!parse_commit(sha, c))
+        return false;
+    parent = c.parent;
+    return true;
+}
+
+// to find the tree and parent of a commit, from the commit-graph when it has
+// the commit; false if the commit is missing
+bool read_commit_links(const string &sha, string &tree, string &parent)
+{
+    commit_graph &graph = get_commit_graph();
+    uint32_t pos;
+    if (graph.find(sha, pos))
+    {
+        tree = graph.tree(pos);
+        parent = graph.parent(pos) == graph_no_parent ? "" : graph.oid(graph.parent(pos));
+        return true;
+    }
+    graph_commit c;
+    if (!parse_commit(sha, c))
+        return false;
+    tree = c.tree;
+    parent = c.parent;
+    return true;
+}
+
+// gc: marks every object reachable from HEAD, the refs and the index, then
+// deletes unreachable loose objects older than the grace period (gc.pruneExpire
+// seconds, two weeks by default, or --prune=<seconds>|now), loose objects that
+// are already in a pack, and temp files left behind by interrupted writes
+
+// objects are known by their position in the sorted list of every object in
+// the repository, and marks are one bit per position, set from any thread
+class reachability
+{
+public:
+    explicit reachability(vector<string> all) : shas(move(all)), missing(0), bits((shas.size() + 63) / 64)
+    {
+        for (auto &word : bits)
+            word = 0;
+    }
+
+    // to set the bit of sha, true only for the call that set it
+    bool mark(const string &sha)
+    {
+        size_t pos;
+        if (!find(sha, pos))
+        {
+            ++missing;
+            return false;
+        }
+        uint64_t bit = 1ULL << (pos % 64);
+        return !(bits[pos / 64].fetch_or(bit, memory_order_relaxed) & bit);
+    }
+
+    bool marked(size_t pos) const { return bits[pos / 64].load(memory_order_relaxed) & (1ULL << (pos % 64)); }
+
+    bool find(const string &sha, size_t &pos) const
+    {
+        auto it = lower_bound(shas.begin(), shas.end(), sha);
+        if (it == shas.end() || *it != sha)
+            return false;
+        pos = it - shas.begin();
+        return true;
+    }
+
+    // to mark a tree and everything below it, subtrees on the pool; blobs are
+    // marked without being read
+    void mark_tree(const string &sha, task_group &group)
+    {
+        if (!mark(sha))
+            return;
+        vector<tree_entry> entries;
+        if (!read_tree(sha, entries))
+            return;
+        for (const tree_entry &entry : entries)
+        {
+            if (entry.type == "tree")
+            {
+                string sub = entry.sha;
+                group.run([this, sub, &group]() { mark_tree(sub, group); });
+            }
+            else if (is_chunked_mode(entry.mode))
+                mark_chunks(entry.sha);
+            else
+                mark(entry.sha);
+        }
+    }
+
+    // to mark the chunk list of a chunked file and its chunks
+    void mark_chunks(const string &sha)
+    {
+        vector<pair<string, uint64_t>> chunks;
+        if (!mark(sha) || !read_chunk_list(sha, chunks))
+            return;
+        for (const auto &chunk : chunks)
+            mark(chunk.first);
+    }
+
+    // to mark a commit and its ancestors, stopping at the first one already
+    // marked; parents and trees come from the commit-graph when it has them
+    void mark_history(string sha, task_group &group)
+    {
+        while (!sha.empty() && mark(sha))
+        {
+            string tree, parent;
+            if (!read_commit_links(sha, tree, parent))
+                return;
+            group.run([this, tree, &group]() { mark_tree(tree, group); });
+            sha = parent;
+        }
+    }
+
+    // the staged blobs and the trees of the cache-tree
+    void mark_index(const cache_tree &node, task_group &group)
+    {
+        if (node.entry_count >= 0)
+        {
+            string sha = node.sha;
+            group.run([this, sha, &group]() { mark_tree(sha, group); });
+            return;
+        }
+        for (const auto &sub : node.subtrees)
+            mark_index(*sub.second, group);
+    }
+
+    const vector<string> shas;
+    // referenced objects that are not in the repository
+    atomic<size_t> missing;
+
+private:
+    vector<atomic<uint64_t>> bits;
+};
+
+// to list HEAD and every file under .mygit/refs with the commit they name,
+// HEAD first; names are relative to .mygit ("HEAD", "refs/heads/main")
+vector<pair<string, string>> list_refs()
+{
+    vector<pair<string, string>> refs;
+    auto add_ref = [&refs](const string &name, const string &content)
+    {
+        string sha = content.substr(0, content.find_first_of(" \t\r\n"));
+        if (sha.size() == SHA_DIGEST_LENGTH * 2 && all_of(sha.begin(), sha.end(), ::isxdigit))
+            refs.push_back({name, sha});
+    };
+    add_ref("HEAD", read_file_if_exists(".mygit/HEAD"));
+    error_code ec;
+    for (filesystem::recursive_directory_iterator it(".mygit/refs", ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (it->is_regular_file())
+            add_ref(it->path().string().substr(strlen(".mygit/")), read_file_if_exists(it->path().string()));
+    }
+    sort(refs.begin() + (refs.empty() || refs[0].first != "HEAD" ? 0 : 1), refs.end());
+    return refs;
+}
+
+int gc_command(int argc, char *argv[])
+{
+    int64_t expire = strtoll(get_config("gc.pruneExpire", "1209600").c_str(), nullptr, 10);
+    for (int i = 2; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--prune=now")
+            expire = 0;
+        else if (starts_with(arg, "--prune=") && isdigit(static_cast<unsigned char>(arg[8])))
+            expire = strtoll(arg.c_str() + 8, nullptr, 10);
+        else
+        {
+            cerr << "Usage: ./mygit gc [--prune=<seconds>|now]" << endl;
+            return 1;
+        }
+    }
+
+    vector<string> loose = list_loose_objects();
+    vector<string> all = loose;
+    for (const pack_file &pack : get_packs())
+    {
+        for (uint32_t i = 0; i < pack.count; ++i)
+            all.push_back(bin_to_hex(pack.oids() + (size_t)i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+    }
+    sort(all.begin(), all.end());
+    all.erase(unique(all.begin(), all.end()), all.end());
+
+    reachability reach(move(all));
+    {
+        task_group group(get_pool());
+        for (const auto &ref : list_refs())
+            reach.mark_history(ref.second, group);
+        index_state &index = get_index();
+        for (const index_entry &e : index.entries)
+        {
+            if (S_ISDIR(e.mode))
+                reach.mark_tree(e.sha, group);
+            else if (index_entry_chunked(e))
+                reach.mark_chunks(e.sha);
+            else
+                reach.mark(e.sha);
+        }
+        reach.mark_index(index.tree, group);
+        group.wait();
+    }
+    size_t reachable = 0;
+    for (size_t i = 0; i < reach.shas.size(); ++i)
+        reachable += reach.marked(i);
+    if (reach.missing > 0)
+        cerr << "Warning: " << reach.missing << " reachable objects are missing." << endl;
+
+    // what a recent unreachable commit or tree points to is kept with it, so
+    // the grace period never leaves a kept object half-pruned
+    time_t cutoff = time(nullptr) - expire;
+    if (expire > 0)
+    {
+        task_group group(get_pool());
+        for (const string &sha : loose)
+        {
+            size_t pos;
+            struct stat st;
+            string type;
+            uint64_t size;
+            if (!reach.find(sha, pos) || reach.marked(pos) || lstat(loose_object_path(sha).c_str(), &st) != 0 ||
+                st.st_mtime <= cutoff || !read_object_header(sha, type, size))
+                continue;
+            if (type == "commit")
+                reach.mark_history(sha, group);
+            else if (type == "tree")
+                reach.mark_tree(sha, group);
+        }
+        group.wait();
+    }
+
+    // the loose copy of a packed object is never needed; an unreachable one
+    // goes once it is older than the grace period
+    size_t pruned = 0, duplicates = 0, temps = 0;
+    uint64_t reclaimed = 0;
+    vector<char> removed(reach.shas.size(), 0);
+    for (const string &sha : loose)
+    {
+        size_t pos;
+        string path = loose_object_path(sha);
+        struct stat st;
+        if (!reach.find(sha, pos) || lstat(path.c_str(), &st) != 0)
+            continue;
+        const pack_file *pack;
+        uint64_t offset;
+        bool packed = find_packed_object(sha, pack, offset);
+        if (!packed && (reach.marked(pos) || (expire > 0 && st.st_mtime > cutoff)))
+            continue;
+        if (unlink(path.c_str()) != 0)
+            continue;
+        reclaimed += st.st_size;
+        if (packed)
+            ++duplicates;
+        else
+        {
+            ++pruned;
+            removed[pos] = 1;
+        }
+    }
+
+    // temp files of writes that never finished
+    vector<string> dirs = {".mygit/objects"};
+    for (int i = 0; i < 256; ++i)
+    {
+        char prefix[3];
+        snprintf(prefix, sizeof(prefix), "%02x", i);
+        dirs.push_back(string(".mygit/objects/") + prefix);
+    }
+    for (const string &dir : dirs)
+    {
+        DIR *d = opendir(dir.c_str());
+        if (!d)
+            continue;
+        struct dirent *entry;
+        while ((entry = readdir(d)) != nullptr)
+        {
+            string path = dir + "/" + entry->d_name;
+            struct stat st;
+            if (starts_with(entry->d_name, "tmp_obj_") && lstat(path.c_str(), &st) == 0 &&
+                (expire == 0 || st.st_mtime <= cutoff) && unlink(path.c_str()) == 0)
+            {
+                reclaimed += st.st_size;
+                ++temps;
+            }
+        }
+        closedir(d);
+        if (dir != ".mygit/objects")
+            rmdir(dir.c_str());
+    }
+
+    // pruned commits leave the commit-graph, the rest keep their rows and filters
+    commit_graph &graph = get_commit_graph();
+    vector<graph_commit> kept;
+    bool graph_changed = false;
+    for (uint32_t i = 0; i < graph.count; ++i)
+    {
+        size_t pos;
+        string sha = graph.oid(i);
+        if (reach.find(sha, pos) && removed[pos])
+        {
+            graph_changed = true;
+            continue;
+        }
+        uint32_t parent = graph.parent(i);
+        kept.push_back({sha, graph.tree(i), parent == graph_no_parent ? "" : graph.oid(parent), graph.commit_time(i)});
+        const unsigned char *filter;
+        size_t len;
+        if (graph.bloom(i, filter, len))
+        {
+            kept.back().bloom.assign(reinterpret_cast<const char *>(filter), len);
+            kept.back().has_bloom = true;
+        }
+    }
+    if (graph_changed)
+    {
+        // a kept commit whose parent was pruned cannot stay either
+        unordered_set<string> present;
+        for (const graph_commit &c : kept)
+            present.insert(c.sha);
+        size_t before;
+        do
+        {
+            before = kept.size();
+            kept.erase(remove_if(kept.begin(), kept.end(), [&present](const graph_commit &c)
+            {
+                if (c.parent.empty() || present.count(c.parent))
+                    return false;
+                present.erase(c.sha);
+                return true;
+            }), kept.end());
+        } while (kept.size() != before);
+        if (kept.empty())
+            unlink(commit_graph_path.c_str());
+        else if (!write_commit_graph(kept))
+            return -1;
+    }
+
+    cout << "Marked " << reachable << " reachable objects out of " << reach.shas.size() << "." << endl;
+    cout << "Pruned " << pruned << " unreachable loose objects, " << duplicates << " packed duplicates and " << temps
+         << " temp files (" << reclaimed << " bytes reclaimed)." << endl;
+    return 0;
+}
+
+// fsmonitor: an optional daemon that keeps inotify watches on every worktree
+// directory and answers "what changed since token X" on .mygit/fsmonitor.sock
+//
+// request : "query <token>\n" or "quit\n"
+// answer  : the new token on the first line, then either "*" (everything may
+//           have changed: unknown or expired token, lost events) or one changed
+//           path per line; a path can be a file or a whole directory
+// a token is "<daemon instance>:<event sequence number>"
+const string fsmonitor_socket = ".mygit/fsmonitor.sock";
+// changed paths remembered by the daemon before older tokens stop being answerable
+const size_t fsmonitor_max_paths = 1 << 20;
+// a client that does not send its request or read the answer within this many
+// seconds is dropped, so one stuck client cannot stall the daemon
+const int fsmonitor_client_timeout = 2;
+
+struct fsmonitor_state
+{
+    int inotify_fd;
+    string instance;
+    uint64_t seq = 0;
+    // sequence numbers at or below this cannot be answered any more
+    uint64_t forgotten = 0;
+    // some directory could not be watched, every answer is "*"
+    bool degraded = false;
+    unordered_map<int, string> dirs;
+    unordered_map<string, uint64_t> changed;
+
+    void record(const string &path)
+    {
+        if (changed.size() >= fsmonitor_max_paths)
+        {
+            changed.clear();
+            forgotten = seq;
+        }
+        changed[path] = ++seq;
+    }
+
+    // to watch dir and everything below it, the files found are reported when
+    // the directory is new (it may have been filled before the watch was added)
+    void watch(const string &dir, bool report)
+    {
+        const uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+        int wd = inotify_add_watch(inotify_fd, dir.empty() ? "." : dir.c_str(), mask);
+        if (wd < 0)
+        {
+            if (!degraded)
+                cerr << "fsmonitor: cannot watch " << (dir.empty() ? "." : dir) << ": " << strerror(errno) << endl;
+            degraded = true;
+            return;
+        }
+        dirs[wd] = dir;
+
+        DIR *d = opendir(dir.empty() ? "." : dir.c_str());
+        if (!d)
+            return;
+        struct dirent *entry;
+        while ((entry = readdir(d)) != nullptr)
+        {
+            string name = entry->d_name;
+            if (name == "." || name == ".." || (dir.empty() && name == ".mygit"))
+                continue;
+            string path = dir.empty() ? name : dir + "/" + name;
+            struct stat st;
+            if (lstat(path.c_str(), &st) != 0)
+                continue;
+            if (S_ISDIR(st.st_mode))
+                watch(path, report);
+            else if (report)
+                record(path);
+        }
+        closedir(d);
+    }
+
+    // to stop watching a directory that was moved away or deleted
+    void unwatch(const string &dir)
+    {
+        for (auto it = dirs.begin(); it != dirs.end();)
+        {
+            if (it->second == dir || starts_with(it->second, dir + "/"))
+            {
+                inotify_rm_watch(inotify_fd, it->first);
+                it = dirs.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    // to read every queued event without blocking
+    void drain()
+    {
+        alignas(struct inotify_event) char buf[64 * 1024];
+        ssize_t n;
+        while ((n = read(inotify_fd, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + n;)
+            {
+                const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // events were lost, nobody can trust an older token
+                    forgotten = ++seq;
+                    continue;
+                }
+                auto it = dirs.find(ev->wd);
+                if (it == dirs.end())
+                    continue;
+                if (ev->mask & IN_IGNORED)
+                {
+                    dirs.erase(it);
+                    continue;
+                }
+                if (ev->len == 0)
+                    continue;
+                string dir = it->second;
+                string name = ev->name;
+                if (dir.empty() && name == ".mygit")
+                    continue;
+                string path = dir.empty() ? name : dir + "/" + name;
+                record(path);
+                if (ev->mask & IN_ISDIR)
+                {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                        watch(path, true);
+                    else if (ev->mask & (IN_MOVED_FROM | IN_DELETE))
+                        unwatch(path);
+                }
+            }
+        }
+    }
+
+    string token() const { return instance + ":" + to_string(seq); }
+
+    string answer(const string &since)
+    {
+        drain();
+        string out = token() + "\n";
+        size_t colon = since.rfind(':');
+        uint64_t since_seq = colon == string::npos ? 0 : strtoull(since.c_str() + colon + 1, nullptr, 10);
+        if (degraded || colon == string::npos || since.substr(0, colon) != instance || since_seq < forgotten ||
+            since_seq > seq)
+            return out + "*\n";
+        for (const auto &item : changed)
+        {
+            if (item.second > since_seq)
+                out += item.first + "\n";
+        }
+        return out;
+    }
+};
+
+// to connect to the fsmonitor of this repository, -1 if none is running
+int fsmonitor_connect()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, fsmonitor_socket.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// to send one request and read the whole answer, false if there is no daemon
+bool fsmonitor_request(const string &request, string &reply)
+{
+    int fd = fsmonitor_connect();
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, request.data(), request.size()) == (ssize_t)request.size();
+    shutdown(fd, SHUT_WR);
+    char buf[64 * 1024];
+    ssize_t n;
+    reply.clear();
+    while (ok && (n = read(fd, buf, sizeof(buf))) > 0)
+        reply.append(buf, n);
+    close(fd);
+    return ok && !reply.empty();
+}
+
+// to ask the daemon what changed since token: false if no daemon answered;
+// full is set when it cannot tell and everything has to be scanned
+bool fsmonitor_query(const string &token, string &new_token, vector<string> &changed, bool &full)
+{
+    string reply;
+    if (!fsmonitor_request("query " + token + "\n", reply))
+        return false;
+    istringstream iss(reply);
+    getline(iss, new_token);
+    full = false;
+    string line;
+    while (getline(iss, line))
+    {
+        if (line == "*")
+            full = true;
+        else
+            changed.push_back(line);
+    }
+    return !new_token.empty();
+}
+
+int fsmonitor_command(const string &action)
+{
+    if (action == "status")
+    {
+        string reply;
+        if (!fsmonitor_request("query\n", reply))
+        {
+            cout << "fsmonitor is not running." << endl;
+            return 1;
+        }
+        cout << "fsmonitor is running, token " << reply.substr(0, reply.find('\n')) << endl;
+        return 0;
+    }
+    if (action == "stop")
+    {
+        string reply;
+        if (!fsmonitor_request("quit\n", reply))
+        {
+            cerr << "fsmonitor is not running." << endl;
+            return 1;
+        }
+        cout << "fsmonitor stopped." << endl;
+        return 0;
+    }
+    if (action != "start")
+    {
+        cerr << "Usage: ./mygit fsmonitor start|stop|status" << endl;
+        return 1;
+    }
+
+    int probe = fsmonitor_connect();
+    if (probe >= 0)
+    {
+        close(probe);
+        cerr << "fsmonitor is already running." << endl;
+        return 1;
+    }
+    // a socket left behind by a daemon that died
+    unlink(fsmonitor_socket.c_str());
+
+    fsmonitor_state state;
+    state.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (state.inotify_fd < 0)
+    {
+        cerr << "fsmonitor: inotify_init1 failed: " << strerror(errno) << endl;
+        return -1;
+    }
+    state.instance = to_string(getpid()) + "-" + to_string(chrono::steady_clock::now().time_since_epoch().count());
+    state.watch("", false);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, fsmonitor_socket.c_str(), sizeof(addr.sun_path) - 1);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd, 16) != 0)
+    {
+        cerr << "fsmonitor: cannot listen on " << fsmonitor_socket << ": " << strerror(errno) << endl;
+        return -1;
+    }
+
+    // the watches and the socket are ready, the rest runs in the background
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        cerr << "fsmonitor: fork failed: " << strerror(errno) << endl;
+        unlink(fsmonitor_socket.c_str());
+        return -1;
+    }
+    if (pid > 0)
+    {
+        cout << "fsmonitor started (pid " << pid << ", " << state.dirs.size() << " directories watched)." << endl;
+        return 0;
+    }
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        close(null_fd);
+    }
+    state.instance = to_string(getpid()) + state.instance.substr(state.instance.find('-'));
+
+    while (true)
+    {
+        struct pollfd fds[2] = {{state.inotify_fd, POLLIN, 0}, {listen_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            state.drain();
+        if (!(fds[1].revents & POLLIN))
+            continue;
+
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+        struct timeval timeout = {fsmonitor_client_timeout, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        string request;
+        char buf[4096];
+        ssize_t n;
+        while (request.find('\n') == string::npos && (n = read(client, buf, sizeof(buf))) > 0)
+            request.append(buf, n);
+        request = request.substr(0, request.find('\n'));
+
+        string reply = starts_with(request, "quit") ? "ok\n" : state.answer(starts_with(request, "query ") ? request.substr(6) : "");
+        for (size_t off = 0; off < reply.size();)
+        {
+            n = send(client, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            off += n;
+        }
+        close(client);
+        if (starts_with(request, "quit"))
+            break;
+    }
+    unlink(fsmonitor_socket.c_str());
+    _exit(0);
+}
+
+// diff: compares two trees, or a tree and the worktree, and prints a unified
+// diff of the files that differ (git's format, 3 lines of context). subtrees
+// with the same SHA on both sides are never read
+
+// lines of context around each change
+const size_t diff_context = 3;
+
+// a file is shown as binary if a NUL byte appears this early in it
+const size_t diff_binary_probe = 8000;
+
+// a line of a file being compared; equal lines of both files get the same id
+struct diff_line
+{
+    const char *data;
+    size_t len;
+    uint64_t hash;
+    uint32_t id;
+};
+
+// to hash a line a word at a time
+inline uint64_t line_hash(const char *p, size_t len)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p + i, len - i);
+    h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 29);
+}
+
+// to split text into lines (each one keeps its newline) and hash them;
+// memchr scans for the newlines with the C library's vectorized search
+void split_lines(const string &text, vector<diff_line> &lines)
+{
+    const char *p = text.data();
+    const char *end = p + text.size();
+    while (p < end)
+    {
+        const char *nl = static_cast<const char *>(memchr(p, '\n', end - p));
+        const char *next = nl ? nl + 1 : end;
+        size_t len = next - p;
+        lines.push_back({p, len, line_hash(p, len), 0});
+        p = next;
+    }
+}
+
+// to give equal lines of both files the same id, so the diff compares integers;
+// returns how many different lines there are
+uint32_t assign_line_ids(vector<diff_line> &a, vector<diff_line> &b)
+{
+    unordered_map<uint64_t, vector<uint32_t>> by_hash;
+    vector<const diff_line *> first;
+    auto assign = [&](diff_line &line)
+    {
+        vector<uint32_t> &ids = by_hash[line.hash];
+        for (uint32_t id : ids)
+        {
+            if (first[id]->len == line.len && memcmp(first[id]->data, line.data, line.len) == 0)
+            {
+                line.id = id;
+                return;
+            }
+        }
+        line.id = first.size();
+        ids.push_back(line.id);
+        first.push_back(&line);
+    };
+    for (diff_line &line : a)
+        assign(line);
+    for (diff_line &line : b)
+        assign(line);
+    return first.size();
+}
+
+// Myers' O(ND) diff in linear space: finds the middle of an edit path between
+// a[0..n) and b[0..m) and splits there; past max_cost edits it settles for the
+// furthest point reached instead of the optimal one, so pathological inputs
+// give a larger diff instead of taking quadratic time
+bool diff_bisect(const uint32_t *a, int n, const uint32_t *b, int m, int max_cost, int &split_x, int &split_y)
+{
+    int max_d = (n + m + 1) / 2;
+    // the search never goes past max_cost edits, so the diagonals it can reach are bounded by that too
+    int offset = min(max_d, max_cost + 1) + 1;
+    vector<int> v1(2 * offset + 2, -1), v2(2 * offset + 2, -1);
+    v1[offset + 1] = 0;
+    v2[offset + 1] = 0;
+    int delta = n - m;
+    bool front = (delta & 1) != 0;
+    int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+    for (int d = 0; d < max_d; ++d)
+    {
+        for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2)
+        {
+            int k1_offset = offset + k1;
+            int x1 = (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])) ? v1[k1_offset + 1]
+                                                                                      : v1[k1_offset - 1] + 1;
+            int y1 = x1 - k1;
+            while (x1 < n && y1 < m && a[x1] == b[y1])
+            {
+                ++x1;
+                ++y1;
+            }
+            v1[k1_offset] = x1;
+            if (x1 > n)
+                k1end += 2;
+            else if (y1 > m)
+                k1start += 2;
+            else if (front)
+            {
+                int k2_offset = offset + delta - k1;
+                if (k2_offset >= 0 && k2_offset < (int)v2.size() && v2[k2_offset] != -1 && x1 >= n - v2[k2_offset])
+                {
+                    split_x = x1;
+                    split_y = y1;
+                    return true;
+                }
+            }
+        }
+        for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2)
+        {
+            int k2_offset = offset + k2;
+            int x2 = (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])) ? v2[k2_offset + 1]
+                                                                                      : v2[k2_offset - 1] + 1;
+            int y2 = x2 - k2;
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1])
+            {
+                ++x2;
+                ++y2;
+            }
+            v2[k2_offset] = x2;
+            if (x2 > n)
+                k2end += 2;
+            else if (y2 > m)
+                k2start += 2;
+            else if (!front)
+            {
+                int k1_offset = offset + delta - k2;
+                if (k1_offset >= 0 && k1_offset < (int)v1.size() && v1[k1_offset] != -1)
+                {
+                    int x1 = v1[k1_offset];
+                    int y1 = x1 - (k1_offset - offset);
+                    if (x1 >= n - x2)
+                    {
+                        split_x = x1;
+                        split_y = y1;
+                        return true;
+                    }
+                }
+            }
+        }
+        if (d >= max_cost)
+        {
+            // too expensive: split where the forward search got furthest
+            int best = -1;
+            for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2)
+            {
+                int x1 = v1[offset + k1];
+                int y1 = x1 - k1;
+                if (x1 >= 0 && x1 <= n && y1 >= 0 && y1 <= m && x1 + y1 > best)
+                {
+                    best = x1 + y1;
+                    split_x = x1;
+                    split_y = y1;
+                }
+            }
+            return best > 0 && best < n + m;
+        }
+    }
+    return false;
+}
+
+// to mark the lines of a (removed) and b (added) that are not on the common path
+void diff_compare(const uint32_t *a, const int *a_pos, int n, const uint32_t *b, const int *b_pos, int m,
+                  int max_cost, vector<char> &removed, vector<char> &added)
+{
+    while (n > 0 && m > 0 && a[0] == b[0])
+    {
+        ++a, ++a_pos, ++b, ++b_pos;
+        --n, --m;
+    }
+    while (n > 0 && m > 0 && a[n - 1] == b[m - 1])
+    {
+        --n;
+        --m;
+    }
+    int x, y;
+    if (n == 0 || m == 0 || !diff_bisect(a, n, b, m, max_cost, x, y) || (x == 0 && y == 0) || (x == n && y == m))
+    {
+        for (int i = 0; i < n; ++i)
+            removed[a_pos[i]] = 1;
+        for (int i = 0; i < m; ++i)
+            added[b_pos[i]] = 1;
+        return;
+    }
+    diff_compare(a, a_pos, x, b, b_pos, y, max_cost, removed, added);
+    diff_compare(a + x, a_pos + x, n - x, b + y, b_pos + y, m - y, max_cost, removed, added);
+}
+
+// to find which lines were removed from a and added in b; lines that only
+// occur on one side are marked first and left out of the Myers search
+void diff_lines(vector<diff_line> &a, vector<diff_line> &b, vector<char> &removed, vector<char> &added)
+{
+    uint32_t ids = assign_line_ids(a, b);
+    vector<char> in_a(ids, 0), in_b(ids, 0);
+    for (const diff_line &line : a)
+        in_a[line.id] = 1;
+    for (const diff_line &line : b)
+        in_b[line.id] = 1;
+
+    removed.assign(a.size(), 0);
+    added.assign(b.size(), 0);
+    vector<uint32_t> a_ids, b_ids;
+    vector<int> a_pos, b_pos;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (in_b[a[i].id])
+        {
+            a_ids.push_back(a[i].id);
+            a_pos.push_back(i);
+        }
+        else
+            removed[i] = 1;
+    }
+    for (size_t i = 0; i < b.size(); ++i)
+    {
+        if (in_a[b[i].id])
+        {
+            b_ids.push_back(b[i].id);
+            b_pos.push_back(i);
+        }
+        else
+            added[i] = 1;
+    }
+    int max_cost = max(256, (int)sqrt((double)a_ids.size() + b_ids.size()));
+    diff_compare(a_ids.data(), a_pos.data(), a_ids.size(), b_ids.data(), b_pos.data(), b_ids.size(), max_cost,
+                 removed, added);
+}
+
+void append_diff_line(string &out, char marker, const diff_line &line)
+{
+    out += marker;
+    out.append(line.data, line.len);
+    if (line.len == 0 || line.data[line.len - 1] != '\n')
+        out += "\n\\ No newline at end of file\n";
+}
+
+string hunk_range(size_t start, size_t count)
+{
+    if (count == 1)
+        return to_string(start + 1);
+    return to_string(count == 0 ? start : start + 1) + "," + to_string(count);
+}
+
+// to append the hunks of a line diff between old_text and new_text
+void unified_diff(const string &old_text, const string &new_text, string &out)
+{
+    vector<diff_line> a, b;
+    split_lines(old_text, a);
+    split_lines(new_text, b);
+    vector<char> removed, added;
+    diff_lines(a, b, removed, added);
+
+    // changes as [i0, i1) of a replaced by [j0, j1) of b, in order
+    struct change
+    {
+        size_t i0, i1, j0, j1;
+    };
+    vector<change> changes;
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size())
+    {
+        if (i < a.size() && j < b.size() && !removed[i] && !added[j])
+        {
+            ++i;
+            ++j;
+            continue;
+        }
+        change c{i, i, j, j};
+        while (i < a.size() && removed[i])
+            ++i;
+        while (j < b.size() && added[j])
+            ++j;
+        c.i1 = i;
+        c.j1 = j;
+        if (c.i0 == c.i1 && c.j0 == c.j1)
+            break;
+        changes.push_back(c);
+    }
+
+    for (size_t first = 0; first < changes.size();)
+    {
+        // changes closer than twice the context share a hunk
+        size_t last = first;
+        while (last + 1 < changes.size() && changes[last + 1].i0 - changes[last].i1 <= 2 * diff_context)
+            ++last;
+        size_t a_start = changes[first].i0 >= diff_context ? changes[first].i0 - diff_context : 0;
+        size_t a_end = min(a.size(), changes[last].i1 + diff_context);
+        size_t b_start = changes[first].j0 - (changes[first].i0 - a_start);
+        size_t b_end = changes[last].j1 + (a_end - changes[last].i1);
+
+        out += "@@ -" + hunk_range(a_start, a_end - a_start) + " +" + hunk_range(b_start, b_end - b_start) + " @@\n";
+        size_t pos = a_start;
+        for (size_t c = first; c <= last; ++c)
+        {
+            for (; pos < changes[c].i0; ++pos)
+                append_diff_line(out, ' ', a[pos]);
+            for (size_t k = changes[c].i0; k < changes[c].i1; ++k)
+                append_diff_line(out, '-', a[k]);
+            for (size_t k = changes[c].j0; k < changes[c].j1; ++k)
+                append_diff_line(out, '+', b[k]);
+            pos = changes[c].i1;
+        }
+        for (; pos < a_end; ++pos)
+            append_diff_line(out, ' ', a[pos]);
+        first = last + 1;
+    }
+}
+
+// the worktree as trees that are hashed but not stored: the encoded trees by
+// SHA, and for each blob that is not in the object store the file it came from
+struct worktree_snapshot
+{
+    unordered_map<string, string> trees;
+    unordered_map<string, string> files;
+};
+
+// to hash the directory dir (index path prefix) into the snapshot, files whose
+// stat data matches the index reuse the staged SHA; "" for an empty directory
+string snapshot_worktree(const string &dir, const string &prefix, worktree_snapshot &snap)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        cerr << "Failed to open directory: " << dir << endl;
+        return "";
+    }
+    vector<string> names;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        string name = entry->d_name;
+        if (name != "." && name != ".." && name != ".mygit")
+            names.push_back(name);
+    }
+    closedir(d);
+
+    vector<tree_entry> entries;
+    for (const string &name : names)
+    {
+        string path = dir + "/" + name;
+        struct stat st;
+        trace_count(counter_stat);
+        if (lstat(path.c_str(), &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            string sha = snapshot_worktree(path, prefix + name + "/", snap);
+            if (!sha.empty())
+                entries.push_back({"tree", sha, name, "40000"});
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            string sha;
+            index_entry *staged = index_find(prefix + name);
+            bool chunked = store_as_chunks(staged, st);
+            if (staged && index_entry_clean(*staged, st))
+            {
+                sha = staged->sha;
+                chunked = index_entry_chunked(*staged);
+            }
+            else if (chunked)
+            {
+                // only the chunk list is hashed, the diff never reads a chunked file
+                if (!store_chunked_file(path, false, sha))
+                    continue;
+            }
+            else
+            {
+                sha = hash_object("blob", read_file(path));
+                snap.files[sha] = path;
+            }
+            string mode = chunked ? "110" : "100";
+            mode += (st.st_mode & S_IXUSR) ? "755" : "644";
+            entries.push_back({"blob", sha, name, mode});
+        }
+    }
+
+    // directories outside the sparse checkout are not in the worktree, the
+    // index has their trees; the search skips over whole subdirectories
+    if (get_sparse_checkout().active())
+    {
+        vector<index_entry> &staged = get_index().entries;
+        auto path_less = [](const index_entry &e, const string &key) { return e.path < key; };
+        auto it = lower_bound(staged.begin(), staged.end(), prefix, path_less);
+        while (it != staged.end() && starts_with(it->path, prefix))
+        {
+            size_t slash = it->path.find('/', prefix.size());
+            if (slash == string::npos)
+            {
+                ++it;
+                continue;
+            }
+            string name = it->path.substr(prefix.size(), slash - prefix.size());
+            if (S_ISDIR(it->mode) && find(names.begin(), names.end(), name) == names.end())
+                entries.push_back({"tree", it->sha, name, "40000"});
+            // '0' follows '/', so this is the first path after the subdirectory
+            it = lower_bound(it, staged.end(), prefix + name + "0", path_less);
+        }
+    }
+    if (entries.empty())
+        return "";
+    string content = encode_tree(entries);
+    string sha = hash_object("tree", content);
+    snap.trees[sha] = content;
+    return sha;
+}
+
+// a file that differs between the two sides; an empty sha means it does not exist there
+struct diff_file
+{
+    string path;
+    string old_sha, old_mode;
+    string new_sha, new_mode;
+};
+
+void diff_read_tree(const string &sha, const worktree_snapshot &snap, vector<tree_entry> &entries)
+{
+    auto it = snap.trees.find(sha);
+    if (it != snap.trees.end())
+        parse_tree(it->second, entries);
+    else if (!read_tree(sha, entries))
+        cerr << "Tree object not found: " << sha << endl;
+}
+
+bool diff_read_blob(const string &sha, const worktree_snapshot &snap, string &content)
+{
+    auto it = snap.files.find(sha);
+    if (it != snap.files.end())
+    {
+        content = read_file(it->second);
+        return true;
+    }
+    shared_ptr<const stored_object> blob = get_object_store().read(sha, "blob");
+    if (!blob)
+        return false;
+    content = blob->content;
+    return true;
+}
+
+// to collect the files that differ between two trees (either may be empty),
+// merging the sorted entries and skipping subtrees with equal SHAs
+void diff_trees(const string &old_tree, const string &new_tree, const string &prefix, const worktree_snapshot &snap,
+                vector<diff_file> &files)
+{
+    if (old_tree == new_tree)
+        return;
+    vector<tree_entry> old_entries, new_entries;
+    if (!old_tree.empty())
+        diff_read_tree(old_tree, snap, old_entries);
+    if (!new_tree.empty())
+        diff_read_tree(new_tree, snap, new_entries);
+
+    size_t i = 0, j = 0;
+    while (i < old_entries.size() || j < new_entries.size())
+    {
+        const tree_entry *a = nullptr, *b = nullptr;
+        if (j == new_entries.size() || (i < old_entries.size() && tree_entry_less(old_entries[i], new_entries[j])))
+            a = &old_entries[i++];
+        else if (i == old_entries.size() || tree_entry_less(new_entries[j], old_entries[i]))
+            b = &new_entries[j++];
+        else
+        {
+            a = &old_entries[i++];
+            b = &new_entries[j++];
+        }
+        if (a && b && a->sha == b->sha && a->mode == b->mode)
+            continue;
+
+        const tree_entry *e = a ? a : b;
+        string path = prefix + e->filename;
+        if (e->type == "tree")
+            diff_trees(a ? a->sha : "", b ? b->sha : "", path + "/", snap, files);
+        else
+            files.push_back({path, a ? a->sha : "", a ? a->mode : "", b ? b->sha : "", b ? b->mode : ""});
+    }
+}
+
+// to print the diff of one file in git's format
+string diff_file_text(const diff_file &f, const worktree_snapshot &snap)
+{
+    string out = "diff --git a/" + f.path + " b/" + f.path + "\n";
+    string old_short = f.old_sha.empty() ? "0000000" : f.old_sha.substr(0, 7);
+    string new_short = f.new_sha.empty() ? "0000000" : f.new_sha.substr(0, 7);
+    if (f.old_sha.empty())
+        out += "new file mode " + f.new_mode + "\nindex " + old_short + ".." + new_short + "\n";
+    else if (f.new_sha.empty())
+        out += "deleted file mode " + f.old_mode + "\nindex " + old_short + ".." + new_short + "\n";
+    else if (f.old_mode != f.new_mode)
+    {
+        out += "old mode " + f.old_mode + "\nnew mode " + f.new_mode + "\n";
+        if (f.old_sha == f.new_sha)
+            return out;
+        out += "index " + old_short + ".." + new_short + "\n";
+    }
+    else
+        out += "index " + old_short + ".." + new_short + " " + f.new_mode + "\n";
+
+    string old_name = f.old_sha.empty() ? "/dev/null" : "a/" + f.path;
+    string new_name = f.new_sha.empty() ? "/dev/null" : "b/" + f.path;
+
+    // chunked files are large binaries, they are not reassembled to be compared
+    if (is_chunked_mode(f.old_mode) || is_chunked_mode(f.new_mode))
+        return out + "Binary files " + old_name + " and " + new_name + " differ\n";
+
+    string old_text, new_text;
+    if ((!f.old_sha.empty() && !diff_read_blob(f.old_sha, snap, old_text)) ||
+        (!f.new_sha.empty() && !diff_read_blob(f.new_sha, snap, new_text)))
+    {
+        cerr << "Failed to read blob for: " << f.path << endl;
+        return out;
+    }
+    if (old_text.empty() && new_text.empty())
+        return out;
+
+    if (memchr(old_text.data(), '\0', min(old_text.size(), diff_binary_probe)) ||
+        memchr(new_text.data(), '\0', min(new_text.size(), diff_binary_probe)))
+    {
+        out += "Binary files " + old_name + " and " + new_name + " differ\n";
+        return out;
+    }
+    out += "--- " + old_name + "\n+++ " + new_name + "\n";
+    unified_diff(old_text, new_text, out);
+    return out;
+}
+
+// to find the tree of a commit or tree SHA, false (with a message) otherwise
+bool resolve_tree(const string &sha, string &tree)
+{
+    string type;
+    uint64_t size;
+    if (!get_object_store().header(sha, type, size))
+    {
+        cerr << "Object not found: " << sha << endl;
+        return false;
+    }
+    if (type == "tree")
+    {
+        tree = sha;
+        return true;
+    }
+    graph_commit c;
+    if (type == "commit" && parse_commit(sha, c))
+    {
+        tree = c.tree;
+        return true;
+    }
+    cerr << "Not a commit or tree: " << sha << endl;
+    return false;
+}
+
+// diff [<old> [<new>]]: without <new> the worktree is compared, without <old> HEAD
+int diff_command(int argc, char *argv[])
+{
+    if (argc > 4)
+    {
+        cerr << "Usage: ./mygit diff [<commit|tree> [<commit|tree>]]" << endl;
+        return 1;
+    }
+    string old_tree, new_tree;
+    worktree_snapshot snap;
+    if (argc > 2)
+    {
+        if (!resolve_tree(argv[2], old_tree))
+            return -1;
+    }
+    else
+    {
+        string head = read_file_if_exists(".mygit/HEAD");
+        while (!head.empty() && isspace(static_cast<unsigned char>(head.back())))
+            head.pop_back();
+        if (!head.empty() && !resolve_tree(head, old_tree))
+            return -1;
+    }
+    if (argc > 3)
+    {
+        if (!resolve_tree(argv[3], new_tree))
+            return -1;
+    }
+    else
+        new_tree = snapshot_worktree(".", "", snap);
+
+    vector<diff_file> files;
+    diff_trees(old_tree, new_tree, "", snap, files);
+
+    // files are diffed on the pool and printed in path order
+    vector<string> texts(files.size());
+    task_group group(get_pool());
+    for (size_t i = 0; i < files.size(); ++i)
+        group.run([&files, &texts, &snap, i]() { texts[i] = diff_file_text(files[i], snap); });
+    group.wait();
+    for (const string &text : texts)
+        cout << text;
+    return 0;
+}
+
+// to write all of out to fd, false if the other end went away
+bool write_all(int fd, const string &out)
+{
+    size_t written = 0;
+    while (written < out.size())
+    {
+        ssize_t n = write(fd, out.data() + written, out.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        written += n;
+    }
+    return true;
+}
+
+// output of cat-file --batch is flushed once it grows past this
+const size_t batch_output_limit = 1 << 16;
+
+// cat-file --batch / --batch-check: reads one object name per line from stdin
+// and answers "<sha> <type> <size>" (followed by the content and a newline with
+// --batch) or "<sha> missing", all in one process so the packs and the object
+// cache stay warm. output is buffered and only flushed when it gets large or
+// no more input is waiting, so a caller can still go request by request
+int cat_file_batch(bool with_content)
+{
+    object_store &store = get_object_store();
+    string out;
+    string in;
+    size_t in_pos = 0;
+    char buf[1 << 16];
+    bool eof = false;
+
+    while (true)
+    {
+        size_t nl = in.find('\n', in_pos);
+        if (nl == string::npos)
+        {
+            if (eof)
+            {
+                if (in_pos == in.size())
+                    break;
+                nl = in.size();
+                in.push_back('\n');
+            }
+            else
+            {
+                in.erase(0, in_pos);
+                in_pos = 0;
+                // about to wait for the caller, so it must have every answer so far
+                struct pollfd pfd = {0, POLLIN, 0};
+                if (!out.empty() && poll(&pfd, 1, 0) == 0)
+                {
+                    if (!write_all(1, out))
+                        return 1;
+                    out.clear();
+                }
+                ssize_t n = read(0, buf, sizeof(buf));
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    eof = true;
+                else
+                    in.append(buf, n);
+                continue;
+            }
+        }
+
+        string line = in.substr(in_pos, nl - in_pos);
+        in_pos = nl + 1;
+        size_t end = line.find_first_of(" \t\r");
+        string sha = line.substr(0, end);
+        if (sha.empty())
+            continue;
+
+        bool valid = sha.size() == SHA_DIGEST_LENGTH * 2 && all_of(sha.begin(), sha.end(), ::isxdigit);
+        string type;
+        uint64_t size = 0;
+        shared_ptr<const stored_object> obj;
+        if (with_content && valid && (obj = store.read(sha)))
+        {
+            out += sha + " " + obj->type + " " + to_string(obj->content.size()) + "\n";
+            out += obj->content;
+            out += "\n";
+        }
+        else if (!with_content && valid && store.header(sha, type, size))
+            out += sha + " " + type + " " + to_string(size) + "\n";
+        else
+            out += sha + " missing\n";
+
+        if (out.size() >= batch_output_limit)
+        {
+            if (!write_all(1, out))
+                return 1;
+            out.clear();
+        }
+    }
+    return write_all(1, out) ? 0 : 1;
+}
+
+// to create an empty repository (.mygit and its directories) in the current directory
+bool init_repository()
+{
+    const string base_dir = ".mygit";
+    const string obj_dir = base_dir + "/objects";
+    const string ref_dir = base_dir + "/refs";
+    const string heads_dir = ref_dir + "/heads";
+    const string tags_dir = ref_dir + "/tags";
+    const string config_file_path = base_dir + "/config";
+
+
+    //creating base directory
+    bool flg;
+    if (mkdir(base_dir.c_str(), 0755) == 0 || errno == EEXIST)
+        flg = true;
+    else
+    {
+        cerr << "Failed to create directory: " << base_dir << endl;
+        flg = false;
+    }
+
+    if (!flg)
+        return false;
+
+    //creating objects directory
+    if (mkdir(obj_dir.c_str(), 0755) == 0 || errno == EEXIST)
+        flg = true;
+    else
+    {
+        cerr << "Failed to create directory: " << obj_dir << endl;
+        flg = false;
+    }
+
+
+    //creating refs directory
+    if (mkdir(ref_dir.c_str(), 0755) == 0 || errno == EEXIST)
+        flg = true;
+    else
+    {
+        cerr << "Failed to create directory: " << ref_dir << endl;
+        flg = false;
+    }
+
+
+    //creating heads directory
+    if (mkdir(heads_dir.c_str(), 0755) == 0 || errno == EEXIST)
+        flg = true;
+    else
+    {
+        cerr << "Failed to create directory: " << heads_dir << endl;
+        flg = false;
+    }
+
+
+    //creating tags directory
+    if (mkdir(tags_dir.c_str(), 0755) == 0 || errno == EEXIST)
+        flg = true;
+    else
+    {
+        cerr << "Failed to create directory: " << tags_dir << endl;
+        flg = false;
+    }
+
+    // create config file
+    ofstream ofs(config_file_path);
+    if (ofs)
+    {
+        ofs.close();
+    }
+    else
+    {
+        cerr << "Failed to create file: " << config_file_path << endl;
+    }
+    return true;
+}
+
+// clone / fetch from another repository on this machine: the source runs as
+// "mygit upload-pack" in its own directory and the two sides talk over pipes
+//
+//   upload-pack : "<sha> <ref>" for HEAD and every ref, then an empty line
+//   fetch       : "want <sha>" for every advertised commit it does not have,
+//                 then rounds of up to fetch_have_batch "have <sha>" lines (its
+//                 own commits, newest first) each ended by "flush"
+//   upload-pack : "ACK <sha>" for every have it has too, then "flush"
+//   fetch       : "done"
+//   upload-pack : if anything was wanted, one pack (as written by repack, whole
+//                 objects only) of everything reachable from the wants that is
+//                 not reachable from the ACKed commits
+//
+// a chain of haves stops at its first ACK (history is linear, so everything
+// below it is common too), and the whole negotiation stops after
+// fetch_max_haves haves in a row without one
+const size_t fetch_have_batch = 32;
+const size_t fetch_max_haves = 256;
+
+// reads lines and then raw bytes from a pipe through one buffer
+struct pipe_reader
+{
+    int fd;
+    string buf;
+    size_t pos = 0;
+
+    explicit pipe_reader(int fd) : fd(fd) {}
+
+    // to append whatever the pipe has next, false at the end of the input
+    bool fill()
+    {
+        char chunk[1 << 16];
+        ssize_t n;
+        do
+            n = read(fd, chunk, sizeof(chunk));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return false;
+        buf.erase(0, pos);
+        pos = 0;
+        buf.append(chunk, n);
+        return true;
+    }
+
+    // to read one line without its newline, false at the end of the input
+    bool read_line(string &line)
+    {
+        size_t scanned = pos, nl;
+        while ((nl = buf.find('\n', scanned)) == string::npos)
+        {
+            scanned = buf.size() - pos;
+            if (!fill())
+                return false;
+        }
+        line.assign(buf, pos, nl - pos);
+        pos = nl + 1;
+        return true;
+    }
+
+    // to read up to len bytes, 0 at the end of the input
+    size_t read_bytes(char *out, size_t len)
+    {
+        if (pos == buf.size() && !fill())
+            return 0;
+        size_t n = min(len, buf.size() - pos);
+        memcpy(out, buf.data() + pos, n);
+        pos += n;
+        return n;
+    }
+};
+
+// to collect what a fetch needs: the commits from the wants down to the first
+// commit the other side has, and the trees and blobs of those commits that are
+// not already in the trees of the commits where the walk stopped
+bool objects_to_send(const vector<string> &wants, const vector<string> &common, vector<string> &objects)
+{
+    // the ACKed commits and all their ancestors are on the other side
+    unordered_set<string> have_commits;
+    for (string sha : common)
+    {
+        string tree, parent;
+        while (!sha.empty() && have_commits.insert(sha).second && read_commit_links(sha, tree, parent))
+            sha = parent;
+    }
+
+    vector<string> trees, boundary;
+    unordered_set<string> sent;
+    for (string sha : wants)
+    {
+        string tree, parent;
+        while (!sha.empty() && !have_commits.count(sha) && sent.insert(sha).second)
+        {
+            if (!read_commit_links(sha, tree, parent))
+            {
+                cerr << "Missing commit: " << sha << endl;
+                return false;
+            }
+            objects.push_back(sha);
+            trees.push_back(tree);
+            sha = parent;
+        }
+        if (have_commits.count(sha) && read_commit_links(sha, tree, parent))
+            boundary.push_back(tree);
+    }
+
+    // everything in the trees of the boundary commits is known to the other side
+    unordered_set<string> known;
+    while (!boundary.empty())
+    {
+        string sha = boundary.back();
+        boundary.pop_back();
+        vector<tree_entry> entries;
+        if (!known.insert(sha).second || !read_tree(sha, entries))
+            continue;
+        for (const tree_entry &entry : entries)
+        {
+            vector<pair<string, uint64_t>> chunks;
+            if (entry.type == "tree")
+                boundary.push_back(entry.sha);
+            else if (known.insert(entry.sha).second && is_chunked_mode(entry.mode) && read_chunk_list(entry.sha, chunks))
+            {
+                for (const auto &chunk : chunks)
+                    known.insert(chunk.first);
+            }
+        }
+    }
+
+    // newest commit first, so its tree is the first one popped
+    reverse(trees.begin(), trees.end());
+    while (!trees.empty())
+    {
+        string sha = trees.back();
+        trees.pop_back();
+        if (known.count(sha) || !sent.insert(sha).second)
+            continue;
+        vector<tree_entry> entries;
+        if (!read_tree(sha, entries))
+        {
+            cerr << "Missing tree: " << sha << endl;
+            return false;
+        }
+        objects.push_back(sha);
+        for (const tree_entry &entry : entries)
+        {
+            if (entry.type == "tree")
+            {
+                trees.push_back(entry.sha);
+                continue;
+            }
+            if (known.count(entry.sha) || !sent.insert(entry.sha).second)
+                continue;
+            objects.push_back(entry.sha);
+
+            // a chunked file that changed usually shares most of its chunks with the known version
+            vector<pair<string, uint64_t>> chunks;
+            if (is_chunked_mode(entry.mode) && !read_chunk_list(entry.sha, chunks))
+            {
+                cerr << "Missing chunk list: " << entry.sha << endl;
+                return false;
+            }
+            for (const auto &chunk : chunks)
+            {
+                if (!known.count(chunk.first) && sent.insert(chunk.first).second)
+                    objects.push_back(chunk.first);
+            }
+        }
+    }
+    return true;
+}
+
+// to stream objects to fd as one pack of whole objects; the zlib streams of
+// loose objects and of whole packed objects are copied without inflating them
+bool send_pack(int fd, const vector<string> &objects)
+{
+    hashing_writer out(fd);
+    string header = "PACK";
+    put_be32(header, pack_version);
+    put_be32(header, objects.size());
+    out.write_bytes(header);
+
+    for (const string &sha : objects)
+    {
+        string compressed;
+        uint64_t size = 0, offset, data_size;
+        const pack_file *pack;
+        unsigned char type;
+        const unsigned char *data;
+        bool packed = find_packed_object(sha, pack, offset);
+        if (packed && pack_entry_at(*pack, offset, type, size, data, data_size) && type == pack_obj_full)
+        {
+            compressed.assign(reinterpret_cast<const char *>(data), data_size);
+        }
+        else if (packed || !inflated_size(compressed = read_file_if_exists(loose_object_path(sha)), size))
+        {
+            string raw;
+            if (!read_raw_object(sha, raw))
+            {
+                cerr << "Corrupt object: " << sha << endl;
+                return false;
+            }
+            size = raw.size();
+            if (!deflate_entry(raw, compressed))
+            {
+                cerr << "Failed to compress object: " << sha << endl;
+                return false;
+            }
+        }
+        string entry_header(1, static_cast<char>(pack_obj_full));
+        put_varint(entry_header, size);
+        put_varint(entry_header, compressed.size());
+        out.write_bytes(entry_header);
+        out.write_bytes(compressed);
+        if (!out.ok)
+            return false;
+    }
+    out.finish();
+    return out.ok;
+}
+
+// upload-pack: the source side of clone and fetch, on stdin / stdout
+int upload_pack()
+{
+    signal(SIGPIPE, SIG_IGN);
+    string out;
+    for (const auto &ref : list_refs())
+        out += ref.second + " " + ref.first + "\n";
+    out += "\n";
+    if (!write_all(STDOUT_FILENO, out))
+        return 1;
+
+    pipe_reader in(STDIN_FILENO);
+    vector<string> wants, common;
+    string line;
+    out.clear();
+    bool done = false;
+    while (!done && in.read_line(line))
+    {
+        string type;
+        uint64_t size;
+        if (starts_with(line, "want "))
+        {
+            wants.push_back(line.substr(5));
+        }
+        else if (starts_with(line, "have "))
+        {
+            string sha = line.substr(5);
+            if (get_object_store().header(sha, type, size) && type == "commit")
+            {
+                common.push_back(sha);
+                out += "ACK " + sha + "\n";
+            }
+        }
+        else if (line == "flush")
+        {
+            out += "flush\n";
+            if (!write_all(STDOUT_FILENO, out))
+                return 1;
+            out.clear();
+        }
+        else if (line == "done")
+        {
+            done = true;
+        }
+    }
+    if (!done)
+        return 1;
+    if (wants.empty())
+        return 0;
+
+    vector<string> objects;
+    if (!objects_to_send(wants, common, objects) || !send_pack(STDOUT_FILENO, objects))
+        return 1;
+    return 0;
+}
+
+// to start upload-pack in the repository at path, to_child / from_child are
+// connected to its stdin / stdout
+pid_t start_upload_pack(const string &path, int &to_child, int &from_child)
 {
-    ifstream ifs(filename, ios::binary);
-    if (!ifs)
+    int request[2], reply[2];
+    if (pipe(request) != 0)
+        return -1;
+    if (pipe(reply) != 0)
     {
-        cerr << "Failed to open file: " << filename << endl;
-        return "";
+        close(request[0]);
+        close(request[1]);
+        return -1;
     }
-    ostringstream oss;
-    oss << ifs.rdbuf();
-    return oss.str();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(request[0], STDIN_FILENO);
+        dup2(reply[1], STDOUT_FILENO);
+        close(request[0]);
+        close(request[1]);
+        close(reply[0]);
+        close(reply[1]);
+        if (chdir(path.c_str()) == 0)
+            execl("/proc/self/exe", "mygit", "upload-pack", static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    close(request[0]);
+    close(reply[1]);
+    if (pid < 0)
+    {
+        close(request[1]);
+        close(reply[0]);
+        return -1;
+    }
+    to_child = request[1];
+    from_child = reply[0];
+    return pid;
 }
 
-// store a compressed blob object into the .mygit/objects directory
-void store_blob(const string &hash, const string &data)
+// to store the pack sent by upload-pack: it goes to a temp file as it arrives,
+// then the checksum is verified and every object is inflated and hashed on the
+// thread pool to build the index; the new pack is added to get_packs()
+bool receive_pack(pipe_reader &in, size_t &count, uint64_t &bytes)
 {
-    // Check if the object already exists
-    bool obj_exist;
-
-    string dir = ".mygit/objects/" + hash.substr(0, 2);
-    string filename = dir + "/" + hash.substr(2);
-    struct stat buffer;
-    obj_exist = (stat(filename.c_str(), &buffer) == 0);
-
-    if (obj_exist)
+    mkdir(".mygit/objects/pack", 0755);
+    string tmp_pack = ".mygit/objects/pack/tmp_pack_XXXXXX";
+    int fd = mkstemp(&tmp_pack[0]);
+    if (fd < 0)
     {
-        // cout << "Object already exists: " << hash << endl;
-        return;
+        cerr << "Failed to create temporary packfile." << endl;
+        return false;
     }
-
-    dir = ".mygit/objects/" + hash.substr(0, 2);
-    filename = dir + "/" + hash.substr(2);
-
-    //create directory 
-    bool flg;
-    if (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST)
-        flg = true;
-    else
+    vector<char> chunk(stream_chunk_size);
+    bool ok = true;
+    size_t n;
+    while (ok && (n = in.read_bytes(chunk.data(), chunk.size())) > 0)
+        ok = write_all(fd, string(chunk.data(), n));
+    if (!ok || fsync(fd) != 0 || close(fd) != 0)
     {
-        cerr << "Failed to create directory: " << dir << endl;
-        flg = false;
+        cerr << "Failed to write packfile." << endl;
+        unlink(tmp_pack.c_str());
+        return false;
     }
-    
-    if(!flg)
-        return;
 
-    ofstream ofs(filename, ios::binary);
-    if (!ofs)
+    pack_file pack;
+    pack.pack_path = tmp_pack;
+    pack.pack = map_file(tmp_pack, pack.pack_size);
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    if (pack.pack && pack.pack_size >= 12 + SHA_DIGEST_LENGTH)
+        sha1_buffer(pack.pack, pack.pack_size - SHA_DIGEST_LENGTH, hash);
+    // every entry takes at least two bytes, so a larger object count is rejected before allocating
+    if (!pack.pack || pack.pack_size < 12 + SHA_DIGEST_LENGTH || memcmp(pack.pack, "PACK", 4) != 0 ||
+        get_be32(pack.pack + 4) == 0 || get_be32(pack.pack + 4) > pack_version ||
+        memcmp(hash, pack.pack + pack.pack_size - SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH) != 0 ||
+        get_be32(pack.pack + 8) > (pack.pack_size - 12 - SHA_DIGEST_LENGTH) / 2)
     {
-        cerr << "Failed to write blob: " << dir + "/" + filename << endl;
-        return;
+        cerr << "Received an invalid pack." << endl;
+        if (pack.pack)
+            munmap(const_cast<unsigned char *>(pack.pack), pack.pack_size);
+        unlink(tmp_pack.c_str());
+        return false;
     }
 
-
-    //compress data
-    uLongf compressed_size = compressBound(data.size());
-    string compressed_data(compressed_size, '\0');
-    if (compress(reinterpret_cast<Bytef *>(&compressed_data[0]), &compressed_size,
-                 reinterpret_cast<const Bytef *>(data.data()), data.size()) != Z_OK)
+    // the entries are found one after the other, their SHA-1s in parallel
+    vector<pair<string, uint64_t>> offsets(get_be32(pack.pack + 8));
+    uint64_t offset = 12;
+    for (auto &item : offsets)
     {
-        throw runtime_error("Data compression failed.");
+        unsigned char type;
+        uint64_t size, data_size;
+        const unsigned char *data;
+        if (!pack_entry_at(pack, offset, type, size, data, data_size))
+        {
+            ok = false;
+            break;
+        }
+        item.second = offset;
+        offset = (data - pack.pack) + data_size;
+    }
+    if (ok && offset == pack.pack_size - SHA_DIGEST_LENGTH)
+    {
+        const size_t per_task = 256;
+        atomic<bool> hashed(true);
+        task_group group(get_pool());
+        for (size_t start = 0; start < offsets.size(); start += per_task)
+        {
+            group.run([&, start]()
+            {
+                for (size_t i = start; i < min(start + per_task, offsets.size()); ++i)
+                {
+                    string raw;
+                    unsigned char sha[SHA_DIGEST_LENGTH];
+                    if (!unpack_entry(pack, offsets[i].second, raw))
+                    {
+                        hashed = false;
+                        return;
+                    }
+                    sha1_buffer(raw.data(), raw.size(), sha);
+                    offsets[i].first = bin_to_hex(sha, SHA_DIGEST_LENGTH);
+                }
+            });
+        }
+        group.wait();
+        ok = hashed;
+    }
+    else
+    {
+        ok = false;
+    }
+    string checksum(reinterpret_cast<const char *>(hash), SHA_DIGEST_LENGTH);
+    munmap(const_cast<unsigned char *>(pack.pack), pack.pack_size);
+    if (!ok)
+    {
+        cerr << "Received a corrupt pack." << endl;
+        unlink(tmp_pack.c_str());
+        return false;
     }
-    compressed_data.resize(compressed_size);
 
-    ofs.write(compressed_data.data(), compressed_data.size());
-    ofs.close();
+    string base;
+    pack_file installed;
+    if (!install_pack(tmp_pack, offsets, checksum, base) || !open_pack(base, installed))
+        return false;
+    get_packs().push_back(installed);
+    count = offsets.size();
+    bytes = installed.pack_size;
+    return true;
 }
 
-// to traverse a directory and collect its entries
-vector<tree_entry> get_directory_entries(const string &path)
+// where a fetched ref of the source is kept: HEAD and branches under
+// refs/remotes/origin, tags as they are; "" for refs that are not fetched
+string fetched_ref_name(const string &name)
 {
-    vector<tree_entry> entries;
-    DIR *dir = opendir(path.c_str());
+    if (name == "HEAD")
+        return "refs/remotes/origin/HEAD";
+    if (starts_with(name, "refs/heads/"))
+        return "refs/remotes/origin/" + name.substr(strlen("refs/heads/"));
+    if (starts_with(name, "refs/tags/"))
+        return name;
+    return "";
+}
 
-    if (!dir)
+bool write_ref(const string &name, const string &sha)
+{
+    string path = ".mygit/" + name;
+    if (!sync_object_writes())
+        return false;
+    error_code ec;
+    filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+    ofstream ofs(path, ios::trunc);
+    ofs << sha;
+    if (!ofs)
     {
-        cerr << "Failed to open directory: " << path << endl;
-        return entries;
+        cerr << "Failed to update ref: " << name << endl;
+        return false;
     }
+    return true;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != nullptr)
+// to fetch from the repository at path into the current one: advertised
+// commits that are missing here are negotiated and received as one pack, then
+// the fetched refs are updated; remote_refs gets what the source advertised
+bool fetch_objects(const string &path, vector<pair<string, string>> &remote_refs)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int to_child, from_child;
+    pid_t pid = start_upload_pack(path, to_child, from_child);
+    if (pid < 0)
     {
-        string name = entry->d_name;
+        cerr << "Failed to start upload-pack: " << strerror(errno) << endl;
+        return false;
+    }
 
-        // skip "." and ".." directories
-        if (name == "." || name == ".." || name==".mygit")
-            continue;
+    pipe_reader in(from_child);
+    string line;
+    bool ok = false;
+    while (in.read_line(line))
+    {
+        if (line.empty())
+        {
+            ok = true;
+            break;
+        }
+        size_t space = line.find(' ');
+        if (space != string::npos)
+            remote_refs.push_back({line.substr(space + 1), line.substr(0, space)});
+    }
 
-        string fullPath = path + "/" + name;
+    string request;
+    unordered_set<string> wants;
+    for (const auto &ref : remote_refs)
+    {
+        if (!get_object_store().exists(ref.second) && wants.insert(ref.second).second)
+            request += "want " + ref.second + "\n";
+    }
 
-        // see if the entry is a file or directory
-        struct stat st;
-        if (stat(fullPath.c_str(), &st) == 0)
+    // haves: walk back from every local ref, one commit of each chain at a time
+    vector<string> chains;
+    for (const auto &ref : list_refs())
+        chains.push_back(ref.second);
+    unordered_set<string> sent;
+    size_t in_vain = 0;
+    while (ok && !wants.empty() && !chains.empty() && in_vain < fetch_max_haves)
+    {
+        unordered_map<string, size_t> batch;
+        for (bool more = true; more && batch.size() < fetch_have_batch;)
         {
-            if (S_ISDIR(st.st_mode))
+            more = false;
+            for (size_t i = 0; i < chains.size() && batch.size() < fetch_have_batch; ++i)
             {
-                // recursively hash the directory (tree object)
-                string tree_sha = write_tree(fullPath);
-                entries.push_back({"tree", tree_sha, name});
+                string sha = chains[i], tree, parent;
+                if (sha.empty())
+                    continue;
+                chains[i].clear();
+                if (!sent.insert(sha).second || !read_commit_links(sha, tree, parent))
+                    continue;
+                request += "have " + sha + "\n";
+                batch[sha] = i;
+                chains[i] = parent;
+                more = true;
             }
-            else if (S_ISREG(st.st_mode))
+        }
+        if (batch.empty())
+            break;
+        request += "flush\n";
+        ok = write_all(to_child, request);
+        request.clear();
+        in_vain += batch.size();
+
+        // an ACKed chain is done: everything below it is common
+        while (ok && (ok = in.read_line(line)) && line != "flush")
+        {
+            auto acked = starts_with(line, "ACK ") ? batch.find(line.substr(4)) : batch.end();
+            if (acked != batch.end())
             {
-                // hash file (blob object)
-                string content = read_file(fullPath);
-                
-                
-                //calculating sha value
-                unsigned char hash[SHA_DIGEST_LENGTH];
-                SHA1(reinterpret_cast<const unsigned char *>(content.c_str()), content.size(), hash);
-                ostringstream oss;
-                for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
-                {
-                    oss << hex << setw(2) << setfill('0') << (int)hash[i];
-                }
-                string blob_sha = oss.str();
-
-
-                store_blob(blob_sha, content);
-                entries.push_back({"blob", blob_sha, name});
+                chains[acked->second].clear();
+                in_vain = 0;
             }
         }
+        chains.erase(remove(chains.begin(), chains.end(), string()), chains.end());
     }
+    ok = ok && write_all(to_child, request + "done\n");
+    close(to_child);
 
-    closedir(dir);
-    return entries;
-}
-
-// to create a tree object and return its SHA-1 value
-string write_tree(const string &path = ".")
-{
-    vector<tree_entry> entries = get_directory_entries(path);
-
-    ostringstream oss;
-    for (const auto &entry : entries)
+    size_t count = 0;
+    uint64_t bytes = 0;
+    if (ok && !wants.empty())
     {
-        oss << entry.type << " " << entry.sha << " " << entry.filename << "\n";
+        ok = receive_pack(in, count, bytes);
+        for (const string &sha : wants)
+        {
+            if (ok && !get_object_store().exists(sha))
+            {
+                cerr << "The source did not send commit " << sha << endl;
+                ok = false;
+            }
+        }
     }
-    string tree_content = oss.str();
-
-
-    //calculating sha value
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const unsigned char *>(tree_content.c_str()), tree_content.size(), hash);
-    ostringstream oss1;
-    for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
+    close(from_child);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
     {
-        oss1 << hex << setw(2) << setfill('0') << (int)hash[i];
+        cerr << "Fetch from " << path << " failed." << endl;
+        return false;
     }
-    string tree_sha = oss1.str();
-
+    if (wants.empty())
+        cout << "Already up to date." << endl;
+    else
+        cout << "Received " << count << " objects (" << bytes << " bytes)." << endl;
 
-    // Check if the tree object already exists
+    for (const auto &ref : remote_refs)
+    {
+        string name = fetched_ref_name(ref.first);
+        if (!name.empty() && !write_ref(name, ref.second))
+            return false;
+    }
+    return true;
+}
 
-    bool obj_exist;
-    string dir = ".mygit/objects/" + tree_sha.substr(0, 2);
-    string filename = dir + "/" + tree_sha.substr(2);
-    struct stat buffer;
-    obj_exist = (stat(filename.c_str(), &buffer) == 0);
+// to put from at to: a hardlink, otherwise (a filesystem that refuses the link)
+// a reflink that shares the blocks, otherwise a plain copy
+bool link_or_copy(const string &from, const string &to)
+{
+    if (link(from.c_str(), to.c_str()) == 0)
+        return true;
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0)
+        return false;
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0444);
+    bool ok = out >= 0 && ioctl(out, FICLONE, in) == 0;
+    if (out >= 0)
+        close(out);
+    close(in);
+    if (ok)
+        return true;
+    unlink(to.c_str());
+    error_code ec;
+    return filesystem::copy_file(from, to, ec);
+}
 
-    
-    if (obj_exist)
+// to link every object, pack and the commit-graph of another repository into
+// this one; they are never modified in place (new ones are written to a temp
+// file and renamed), so both repositories can share the files
+bool link_objects(const string &source, size_t &files)
+{
+    error_code ec;
+    string from = source + "/.mygit/objects";
+    for (filesystem::recursive_directory_iterator it(from, ec), end; !ec && it != end; it.increment(ec))
     {
-        // cout << "Tree object already exists: " << tree_sha << endl;
-        return tree_sha;
+        string relative = it->path().string().substr(from.size());
+        string name = it->path().filename().string();
+        string target = ".mygit/objects" + relative;
+        if (it->is_directory())
+        {
+            mkdir(target.c_str(), 0755);
+            continue;
+        }
+        if (!it->is_regular_file() || starts_with(name, "tmp_") ||
+            (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) || access(target.c_str(), F_OK) == 0)
+            continue;
+        if (!link_or_copy(it->path().string(), target))
+        {
+            cerr << "Failed to copy " << it->path().string() << ": " << strerror(errno) << endl;
+            return false;
+        }
+        ++files;
     }
-
-    // Store the tree object
-    store_blob(tree_sha, tree_content);
-    return tree_sha;
+    return !ec;
 }
 
-bool starts_with(const string &str, const string &prefix)
+// fetch [<path>]: without a path, the repository this one was cloned from
+int fetch_command(int argc, char *argv[])
 {
-    return str.size() >= prefix.size() && str.compare(0, prefix.size(), prefix) == 0;
+    string path = argc > 2 ? argv[2] : get_config("remote.origin.url");
+    if (path.empty())
+    {
+        cerr << "Usage: ./mygit fetch <path of repository>" << endl;
+        return -1;
+    }
+    struct stat st;
+    if (stat(".mygit", &st) != 0 || stat((path + "/.mygit").c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        cerr << "Not a mygit repository: " << (stat(".mygit", &st) != 0 ? "." : path) << endl;
+        return -1;
+    }
+    vector<pair<string, string>> remote_refs;
+    return fetch_objects(path, remote_refs) ? 0 : -1;
 }
 
-// to restore files and directories from a tree object
-void restore_tree(const string &tree_sha, const string &path = ".")
+// clone [--no-local] <path> [<dir>]: objects of a source on the same
+// filesystem are hardlinked, anything else is fetched as one pack
+bool clone_into(const string &source, bool local)
 {
-    string dir = ".mygit/objects/" + tree_sha.substr(0, 2);
-    string filename = dir + "/" + tree_sha.substr(2);
+    if (!init_repository())
+        return false;
+    ofstream config(".mygit/config", ios::app);
+    config << "remote.origin.url = " << source << endl;
+    if (!config)
+    {
+        cerr << "Failed to write .mygit/config" << endl;
+        return false;
+    }
 
-    string compressed_content = read_file(filename);
-    if (compressed_content.empty())
+    struct stat from, to;
+    size_t linked = 0;
+    if (local && stat((source + "/.mygit/objects").c_str(), &from) == 0 && stat(".mygit/objects", &to) == 0 &&
+        from.st_dev == to.st_dev)
     {
-        cerr << "Tree object not found: " << tree_sha << endl;
-        return;
+        if (!link_objects(source, linked))
+            return false;
+        cout << "Linked " << linked << " object files." << endl;
     }
 
+    vector<pair<string, string>> remote_refs;
+    if (!fetch_objects(source, remote_refs))
+        return false;
+    for (const auto &ref : remote_refs)
+    {
+        if (starts_with(ref.first, "refs/heads/") && !write_ref(ref.first, ref.second))
+            return false;
+    }
+    if (remote_refs.empty() || remote_refs[0].first != "HEAD")
+    {
+        cout << "Cloned an empty repository." << endl;
+        return true;
+    }
 
-    //decompressed data from compressed data
-    uLongf decompressed_size = compressed_content.size() * 4;
-    string decompressed_data(decompressed_size, '\0');
-    while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data[0]), &decompressed_size,
-                      reinterpret_cast<const Bytef *>(compressed_content.data()), compressed_content.size()) == Z_BUF_ERROR)
+    string commit_sha = remote_refs[0].second, tree_sha, parent;
+    if (!read_commit_links(commit_sha, tree_sha, parent))
     {
-        decompressed_size *= 2;
-        decompressed_data.resize(decompressed_size);
+        cerr << "Commit not found: " << commit_sha << endl;
+        return false;
     }
-    decompressed_data.resize(decompressed_size);
-    string content = decompressed_data;
+    unordered_set<string> written;
+    if (!lock_index() || !restore_tree(tree_sha, written))
+        return false;
+    reset_index(tree_sha, written);
+    if (!write_index() || !write_ref("HEAD", commit_sha))
+        return false;
+    // a linked commit-graph already covers HEAD
+    if (!linked && get_config("core.commitGraph", "true") != "false")
+        update_commit_graph(false);
+    cout << "Checked out commit: " << commit_sha << endl;
+    return true;
+}
 
-    istringstream iss(content);
-    string line;
+int clone_command(int argc, char *argv[])
+{
+    bool local = true;
+    vector<string> args;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--no-local")
+            local = false;
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.empty() || args.size() > 2)
+    {
+        cerr << "Usage: ./mygit clone [--no-local] <path of repository> [<directory>]" << endl;
+        return -1;
+    }
 
-    while (getline(iss, line))
+    error_code ec;
+    filesystem::path source = filesystem::canonical(args[0], ec);
+    if (ec || !filesystem::is_directory(source / ".mygit"))
     {
-        istringstream entry_stream(line);
-        tree_entry entry;
-        entry_stream >> entry.type >> entry.sha >> entry.filename;
+        cerr << "Not a mygit repository: " << args[0] << endl;
+        return -1;
+    }
+    string dir = args.size() > 1 ? args[1] : source.filename().string();
+    if (filesystem::exists(dir) && !filesystem::is_empty(dir, ec))
+    {
+        cerr << "Destination already exists and is not empty: " << dir << endl;
+        return -1;
+    }
+    bool created = !filesystem::exists(dir);
+    filesystem::path origin = filesystem::current_path();
+    if (!filesystem::create_directories(dir, ec) && ec)
+    {
+        cerr << "Failed to create directory: " << dir << endl;
+        return -1;
+    }
 
-        string fullPath = path + "/" + entry.filename;
+    cout << "Cloning into '" << dir << "'..." << endl;
+    if (chdir(dir.c_str()) == 0 && clone_into(source.string(), local))
+        return 0;
 
-        if (entry.type == "blob")
-        {
-            // restore file from blob
+    // nothing is left behind of a clone that failed
+    filesystem::current_path(origin, ec);
+    if (created)
+        filesystem::remove_all(dir, ec);
+    else
+        filesystem::remove_all(filesystem::path(dir) / ".mygit", ec);
+    return -1;
+}
 
+// microbenchmark for the SHA-1 engines: hashes count messages of size bytes
+// with every engine this CPU supports and checks they all agree
+int bench_hash(size_t count, size_t size)
+{
+    string data(count * size, '\0');
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    for (char &c : data)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        c = static_cast<char>(seed);
+    }
+    vector<sha1_message> messages;
+    for (size_t i = 0; i < count; ++i)
+        messages.push_back({reinterpret_cast<const unsigned char *>(data.data()) + i * size, size});
 
-            //read content of file
-            string filename = ".mygit/objects/" + entry.sha.substr(0, 2) + "/" + entry.sha.substr(2);
-            ifstream ifs(filename, ios::binary);
-            if (!ifs)
-            {
-                cerr << "Failed to open file: " << filename << endl;
-                return;
-            }
+    vector<string> reference;
+    auto run = [&](const string &name, function<void(vector<string> &)> engine)
+    {
+        vector<string> hex;
+        hex.reserve(count);
+        auto start = chrono::steady_clock::now();
+        engine(hex);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool agrees = reference.empty() || hex == reference;
+        if (reference.empty())
+            reference = hex;
+        cout << left << setw(24) << name << right << fixed << setprecision(2)
+             << setw(10) << seconds * 1000 << " ms" << setw(10) << data.size() / seconds / 1e6 << " MB/s"
+             << setw(12) << seconds * 1e9 / count << " ns/msg" << (agrees ? "" : "  MISMATCH") << endl;
+        return agrees;
+    };
+
+    cout << count << " messages of " << size << " bytes" << endl;
+    bool ok = true;
+    // what every SHA-1 went through before: one-shot SHA1() and an ostringstream per byte
+    ok &= run("SHA1() + ostringstream", [&](vector<string> &hex)
+    {
+        for (const sha1_message &m : messages)
+        {
+            unsigned char hash[SHA_DIGEST_LENGTH];
+            SHA1(m.first, m.second, hash);
             ostringstream oss;
-            oss << ifs.rdbuf();
-            string data = oss.str();
-
-
-            //decompressed data
-            uLongf decompressed_size = data.size() * 4;
-            string decompressed_data(decompressed_size, '\0');
-            while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data[0]), &decompressed_size,
-                      reinterpret_cast<const Bytef *>(data.data()), data.size()) == Z_BUF_ERROR)
-            {
-                decompressed_size *= 2;
-                decompressed_data.resize(decompressed_size);
-            }
-            decompressed_data.resize(decompressed_size);
-            string blob_content = decompressed_data;
-
-            ofstream ofs(fullPath, ios::binary);
-            if (!ofs)
-            {
-                cerr << "Failed to restore file: " << fullPath << endl;
-                continue;
-            }
-            ofs << blob_content;
-            ofs.close();
+            for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
+                oss << std::hex << setw(2) << setfill('0') << (int)hash[i];
+            hex.push_back(oss.str());
         }
-        else if (entry.type == "tree")
+    });
+    ok &= run("OpenSSL EVP", [&](vector<string> &hex)
+    {
+        for (const sha1_message &m : messages)
         {
-            // create directory and recursively restore tree
-            bool flg;
-            if (mkdir(fullPath.c_str(), 0755) == 0 || errno == EEXIST)
-                flg = true;
-            else
+            sha1 ctx(false);
+            ctx.update(m.first, m.second);
+            hex.push_back(ctx.final_hex());
+        }
+    });
+#if defined(__x86_64__) || defined(__i386__)
+    if (get_cpu_features().sha_ni)
+    {
+        ok &= run("SHA-NI", [&](vector<string> &hex)
+        {
+            for (const sha1_message &m : messages)
             {
-                cerr << "Failed to create directory: " << fullPath << endl;
-                flg = false;
+                sha1 ctx(true);
+                ctx.update(m.first, m.second);
+                hex.push_back(ctx.final_hex());
             }
-            restore_tree(entry.sha, fullPath);
-        }
+        });
     }
-}
-
-int main(int argc, char *argv[])
-{
-    if (argc < 2)
+    if (get_cpu_features().avx2)
     {
-        cerr << "Usage: ./mygit <command> [options]" << endl;
-        return 1;
+        ok &= run("AVX2 x8", [&](vector<string> &hex)
+        {
+            vector<unsigned char> out(count * SHA_DIGEST_LENGTH);
+            sha1_many_x8(messages, out.data());
+            for (size_t i = 0; i < count; ++i)
+                hex.push_back(bin_to_hex(out.data() + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+        });
     }
-
-    string command = argv[1];
-    if (command == "init")
+#endif
+    ok &= run("sha1_many", [&](vector<string> &hex)
     {
-        const string base_dir = ".mygit";
-        const string obj_dir = base_dir + "/objects";
-        const string ref_dir = base_dir + "/refs";
-        const string heads_dir = ref_dir + "/heads";
-        const string tags_dir = ref_dir + "/tags";
-        const string config_file_path = base_dir + "/config";
-
+        vector<unsigned char> out(count * SHA_DIGEST_LENGTH);
+        sha1_many(messages, out.data());
+        for (size_t i = 0; i < count; ++i)
+            hex.push_back(bin_to_hex(out.data() + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH));
+    });
+    return ok ? 0 : 1;
+}
 
-        //creating base directory
-        bool flg;
-        if (mkdir(base_dir.c_str(), 0755) == 0 || errno == EEXIST)
-            flg = true;
-        else
+// to strip "-j N" / "-jN" from the arguments, the value after "-m" is left alone
+void parse_jobs_option(int &argc, char *argv[])
+{
+    int out = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "-m" && i + 1 < argc)
         {
-            cerr << "Failed to create directory: " << base_dir << endl;
-            flg = false;
+            argv[out++] = argv[i++];
+            argv[out++] = argv[i];
         }
-
-        if (!flg)
-            return 1;
-
-        //creating objects directory
-        if (mkdir(obj_dir.c_str(), 0755) == 0 || errno == EEXIST)
-            flg = true;
-        else
+        else if (arg == "-j" && i + 1 < argc)
         {
-            cerr << "Failed to create directory: " << obj_dir << endl;
-            flg = false;
+            num_jobs = atoi(argv[++i]);
         }
-
-
-        //creating refs directory
-        if (mkdir(ref_dir.c_str(), 0755) == 0 || errno == EEXIST)
-            flg = true;
-        else
+        else if (starts_with(arg, "-j") && arg.size() > 2 && isdigit(arg[2]))
         {
-            cerr << "Failed to create directory: " << ref_dir << endl;
-            flg = false;
+            num_jobs = atoi(arg.c_str() + 2);
         }
-
-
-        //creating heads directory
-        if (mkdir(heads_dir.c_str(), 0755) == 0 || errno == EEXIST)
-            flg = true;
         else
         {
-            cerr << "Failed to create directory: " << heads_dir << endl;
-            flg = false;
+            argv[out++] = argv[i];
         }
+    }
+    argc = out;
+}
 
+int main(int argc, char *argv[])
+{
+    parse_jobs_option(argc, argv);
+    start_trace(argc, argv);
 
-        //creating tags directory
-        if (mkdir(tags_dir.c_str(), 0755) == 0 || errno == EEXIST)
-            flg = true;
-        else
-        {
-            cerr << "Failed to create directory: " << tags_dir << endl;
-            flg = false;
-        }
-
-        // create config file
-        ofstream ofs(config_file_path);
-        if (ofs)
-        {
-            ofs.close();
-        }
-        else
-        {
-            cerr << "Failed to create file: " << config_file_path << endl;
-        }
+    if (argc < 2)
+    {
+        cerr << "Usage: ./mygit [-j <jobs>] <command> [options]" << endl;
+        return 1;
+    }
 
+    string command = argv[1];
+    if (command == "init")
+    {
+        if (!init_repository())
+            return 1;
         cout << "Initialized empty mygit repository in .mygit/" << endl;
     }
     else if (command == "cat-file")
     {
+        if (argc == 3 && (string(argv[2]) == "--batch" || string(argv[2]) == "--batch-check"))
+            return cat_file_batch(string(argv[2]) == "--batch");
         if (argc < 4)
         {
-            cerr << "Usage: ./mygit cat-file <flag> <file_sha>" << endl;
+            cerr << "Usage: ./mygit cat-file <flag> <file_sha> | ./mygit cat-file --batch | --batch-check" << endl;
             return 1;
         }
         string flag = argv[2];
         string sha = argv[3];
 
-        string dir = ".mygit/objects/" + sha.substr(0, 2);
-        string filename = dir + "/" + sha.substr(2);
-
-        string compressed_content = read_file(filename);
-        if (compressed_content.empty())
-        {
-            cerr << "Object not found: " << sha << endl;
-            return -1;
-        }
-
-
-         //decompressed data
-        uLongf decompressed_size = compressed_content.size() * 4;
-        string decompressed_data(decompressed_size, '\0');
-        while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data[0]), &decompressed_size,
-        reinterpret_cast<const Bytef *>(compressed_content.data()), compressed_content.size()) == Z_BUF_ERROR)
+        // -s and -t only need the object header, not the content
+        object_store &store = get_object_store();
+        string type;
+        uint64_t size;
+        if (flag == "-s" || flag == "-t")
         {
-            decompressed_size *= 2;
-            decompressed_data.resize(decompressed_size);
+            if (!store.header(sha, type, size))
+            {
+                cerr << "Object not found: " << sha << endl;
+                return -1;
+            }
         }
-        decompressed_data.resize(decompressed_size);
-        string content = decompressed_data;
-
 
         if (flag == "-p")
         {
-            cout << content << endl;
+            shared_ptr<const stored_object> obj = store.read(sha);
+            if (!obj)
+            {
+                cerr << "Object not found: " << sha << endl;
+                return -1;
+            }
+            cout << obj->content << endl;
         }
         else if (flag == "-s")
         {
-            cout << "Size: " << content.size() << " bytes" << endl;
+            cout << "Size: " << size << " bytes" << endl;
         }
         else if (flag == "-t")
         {
-            cout << "Type: blob" << endl;
+            cout << "Type: " << type << endl;
         }
         else
         {
@@ -454,81 +7014,95 @@ int main(int argc, char *argv[])
         {
             filename = argv[2];
         }
-        string data = read_file(filename);
-        if (data.empty())
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0 || st.st_size == 0)
         {
             cerr << "No data read from file: " << filename << endl;
             return 1;
         }
-
-
-
-        //calculating sha value
-        unsigned char hash[SHA_DIGEST_LENGTH];
-        SHA1(reinterpret_cast<const unsigned char *>(data.c_str()), data.size(), hash);
-        ostringstream oss;
-        for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
-        {
-            oss << hex << setw(2) << setfill('0') << (int)hash[i];
-        }
-        string hash1 = oss.str();
-        cout << "SHA-1:" << hash1 << endl;
-        if (write)
+
+        // hash (and with -w compress) the file chunk by chunk
+        string hash1;
+        if (!hash_file_streaming(filename, write, hash1))
         {
-            store_blob(hash1, data);
+            return 1;
         }
+        cout << "SHA-1:" << hash1 << endl;
     }
     else if (command == "write-tree")
     {
-        string tree_sha = write_tree();
+        if (!lock_index())
+            return 1;
+        string tree_sha = get_index().entries.empty() ? write_tree() : write_index_tree();
+        if (tree_sha.empty())
+        {
+            cerr << "Failed to write tree." << endl;
+            return 1;
+        }
+        if (get_index().dirty && !write_index())
+            return 1;
         cout << "Tree SHA-1: " << tree_sha << endl;
     }
     else if (command == "ls-tree")
     {
-        bool name_only = (argc == 4 && string(argv[2]) == "--name-only");
-        string tree_sha = argv[name_only ? 3 : 2];
-
-        string dir = ".mygit/objects/" + tree_sha.substr(0, 2);
-        string filename = dir + "/" + tree_sha.substr(2);
+        bool name_only = (argc >= 4 && string(argv[2]) == "--name-only");
+        int first = name_only ? 3 : 2;
+        if (argc <= first)
+        {
+            cerr << "Usage: ./mygit ls-tree [--name-only] <tree_sha> [path]" << endl;
+            return 1;
+        }
+        string tree_sha = argv[first];
+        string path = argc > first + 1 ? normalize_path(argv[first + 1]) : "";
 
-        string compressed_content = read_file(filename);
-        if (compressed_content.empty())
+        object_store &store = get_object_store();
+        vector<tree_entry> entries;
+        if (!read_tree(tree_sha, entries))
         {
-            cerr << "Object not found: " << tree_sha << endl;
+            string type;
+            uint64_t size;
+            if (!store.header(tree_sha, type, size))
+                cerr << "Object not found: " << tree_sha << endl;
+            else if (type != "tree")
+                cerr << "Not a tree object: " << tree_sha << " (" << type << ")" << endl;
             return -1;
         }
 
-
-        //decompressed data
-        uLongf decompressed_size = compressed_content.size() * 4;
-        string decompressed_data(decompressed_size, '\0');
-        while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data[0]), &decompressed_size,
-        reinterpret_cast<const Bytef *>(compressed_content.data()), compressed_content.size()) == Z_BUF_ERROR)
+        // a path is looked up one component at a time, each a binary search
+        // in the sorted entries; "dir" shows the entry, "dir/" what is inside
+        string prefix;
+        while (!path.empty())
         {
-            decompressed_size *= 2;
-            decompressed_data.resize(decompressed_size);
+            size_t slash = path.find('/');
+            string name = path.substr(0, slash);
+            string rest = slash == string::npos ? "" : path.substr(slash + 1);
+            const tree_entry *found = find_tree_entry(entries, name);
+            if (!found || (slash != string::npos && found->type != "tree"))
+                return 0;
+            if (rest.empty() && slash == string::npos)
+            {
+                tree_entry only = *found;
+                entries.assign(1, only);
+                break;
+            }
+            string sub_sha = found->sha;
+            entries.clear();
+            if (!read_tree(sub_sha, entries))
+                return -1;
+            prefix += name + "/";
+            path = rest;
         }
-        decompressed_data.resize(decompressed_size);
-        string content = decompressed_data;
-        
-
-        istringstream iss(content);
-        string line;
 
-        while (getline(iss, line))
+        for (const tree_entry &entry : entries)
         {
-            istringstream entryStream(line);
-            tree_entry entry;
-            entryStream >> entry.type >> entry.sha >> entry.filename;
-
             if (name_only)
             {
-                cout << entry.filename << endl;
+                cout << prefix << entry.filename << endl;
             }
             else
             {
-                cout << setw(6) << (entry.type == "tree" ? "040000" : "100644")
-                     << " " << entry.type << " " << entry.sha << " " << entry.filename << endl;
+                cout << setw(6) << setfill('0') << entry.mode << setfill(' ')
+                     << " " << entry.type << " " << entry.sha << " " << prefix << entry.filename << endl;
             }
         }
     }
@@ -540,136 +7114,275 @@ int main(int argc, char *argv[])
             cerr << "Usage: ./mygit add <file1> <file2> ... | ./mygit add ." << endl;
             return 1;
         }
+        if (!lock_index())
+            return 1;
 
-        // Initialize index file if it doesn't exist
-        ofstream index_file(".mygit/index", ios::app);
-        if (!index_file)
+        index_state &index = get_index();
+        vector<string> files;
+        bool add_all = string(argv[2]) == ".";
+
+        // with a running fsmonitor only the paths changed since the last "add ." are looked at
+        string new_token;
+        vector<string> changed;
+        bool full_scan = true;
+        bool monitored = add_all && fsmonitor_query(index.fsmonitor_token, new_token, changed, full_scan);
+        if (monitored)
         {
-            cerr << "Failed to open index file." << endl;
-            return -1;
+            index.fsmonitor_token = new_token;
+            index.dirty = true;
         }
-        index_file.close();
 
-        if (string(argv[2]) == ".")
+        if (monitored && !full_scan)
+        {
+            trace_scope scope(phase_walk);
+            set<string> unique_files;
+            vector<bool> removed(index.entries.size(), false);
+            for (const string &path : changed)
+            {
+                struct stat st;
+                trace_count(counter_stat);
+                if (lstat(path.c_str(), &st) != 0)
+                {
+                    // removed, possibly a whole directory: the path itself and the
+                    // range of entries below it are found by binary search
+                    if (index_entry *e = index_find(path))
+                        removed[e - index.entries.data()] = true;
+                    string prefix = path + "/";
+                    auto it = lower_bound(index.entries.begin(), index.entries.end(), prefix,
+                                          [](const index_entry &e, const string &key) { return e.path < key; });
+                    for (; it != index.entries.end() && starts_with(it->path, prefix); ++it)
+                        removed[it - index.entries.begin()] = !S_ISDIR(it->mode);
+                }
+                else if (S_ISDIR(st.st_mode))
+                {
+                    for (const auto &entry : filesystem::recursive_directory_iterator(path))
+                    {
+                        if (entry.is_regular_file())
+                            unique_files.insert("./" + entry.path().string());
+                    }
+                }
+                else if (S_ISREG(st.st_mode))
+                    unique_files.insert("./" + path);
+            }
+            vector<index_entry> kept;
+            kept.reserve(index.entries.size());
+            for (size_t i = 0; i < index.entries.size(); ++i)
+            {
+                if (!removed[i])
+                {
+                    kept.push_back(move(index.entries[i]));
+                    continue;
+                }
+                cache_tree_invalidate(index.entries[i].path);
+                cout << "Removed " << index.entries[i].path << " from staging area." << endl;
+            }
+            index.entries.swap(kept);
+            files.assign(unique_files.begin(), unique_files.end());
+            add_all = false;
+        }
+        else if (add_all)
         {
             // add all files in the current directory recursively
+            trace_scope scope(phase_walk);
             for (const auto &entry : filesystem::recursive_directory_iterator("."))
             {
                 if (entry.is_regular_file() && entry.path().string().find(".mygit") == std::string::npos)
                 {
-                    string file = entry.path().string();
-                    string content = read_file(file);
-
-                    if (content.empty())
-                    {
-                        cerr << "Either file created now (which is empty) or Failed to read file: " << file << endl;
-                        continue;
-                    }
-
-
-
-
-                    //calculating sha value
-                    unsigned char hash[SHA_DIGEST_LENGTH];
-                    SHA1(reinterpret_cast<const unsigned char *>(content.c_str()), content.size(), hash);
-                    ostringstream oss;
-                    for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
-                    {
-                        oss << hex << setw(2) << setfill('0') << (int)hash[i];
-                    }
-                    string sha = oss.str();
-
-                    bool already_staged = false;
-
-                    // Check if the SHA already exists in the index
-                    ifstream index_read(".mygit/index");
-                    string line;
-                    while (getline(index_read, line))
-                    {
-                        if (line.find(sha) != string::npos)
-                        {
-                            already_staged = true;
-                            break;
-                        }
-                    }
-                    index_read.close();
-
-                    if (!already_staged)
-                    {
-                        store_blob(sha, content);
-                        // update the index file with the file and its SHA value
-                        index_file.open(".mygit/index", ios::app);
-                        index_file << sha << " " << file << endl;
-                        index_file.close();
-                        cout << "Added " << file << " to staging area." << endl;
-                    }
-                    else
-                    {
-                        cout << "Skipped " << file << ", already staged." << endl;
-                    }
+                    files.push_back(entry.path().string());
                 }
             }
         }
         else
         {
             // Add specific files to the index
-            vector<string> files(argv + 2, argv + argc);
-            for (const string &file : files)
+            files.assign(argv + 2, argv + argc);
+        }
+
+        vector<index_entry> added;
+
+        // to record the SHA of a file in the index and report it
+        auto stage = [&](const string &file, const string &key, index_entry *staged, const struct stat &st,
+                         const string &sha, bool chunked = false)
+        {
+            bool already_staged = (staged && staged->sha == sha);
+            if (!already_staged || (staged->mode & S_IXUSR) != (st.st_mode & S_IXUSR))
+                cache_tree_invalidate(key);
+
+            // update the index entry with the SHA value and current stat data,
+            // new paths are merged into the sorted index after the loop
+            if (staged)
+            {
+                staged->sha = sha;
+                fill_stat_data(*staged, st);
+                if (chunked)
+                    mark_chunked(*staged);
+                index.dirty = true;
+            }
+            else
+            {
+                index_entry e;
+                e.path = key;
+                e.sha = sha;
+                fill_stat_data(e, st);
+                if (chunked)
+                    mark_chunked(e);
+                added.push_back(e);
+            }
+
+            if (!already_staged)
+                cout << "Added " << file << " to staging area." << endl;
+            else
+                cout << "Skipped " << file << ", already staged." << endl;
+        };
+
+        // small files are read whole and hashed in batches (sha1_many); only
+        // the ones whose object does not exist yet get compressed and written
+        struct pending_file
+        {
+            string file;
+            string key;
+            index_entry *staged;
+            struct stat st;
+            string object;
+        };
+        vector<pending_file> pending;
+        // a file whose object could not be stored is not staged, and add fails
+        bool store_failed = false;
+        auto flush_pending = [&]()
+        {
+            vector<sha1_message> messages;
+            for (const pending_file &f : pending)
+                messages.push_back({reinterpret_cast<const unsigned char *>(f.object.data()), f.object.size()});
+            vector<unsigned char> hashes(pending.size() * SHA_DIGEST_LENGTH);
             {
-                string content = read_file(file);
-                if (content.empty())
+                trace_scope scope(phase_hash);
+                sha1_many(messages, hashes.data());
+            }
+            for (size_t i = 0; i < pending.size(); ++i)
+            {
+                string sha = bin_to_hex(hashes.data() + i * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+                if (!object_exists(sha) && !write_loose_object(sha, pending[i].object))
                 {
-                    cerr << "Failed to read file: " << file << endl;
+                    store_failed = true;
                     continue;
                 }
+                stage(pending[i].file, pending[i].key, pending[i].staged, pending[i].st, sha);
+            }
+            pending.clear();
+        };
+
+        const sparse_checkout &sparse = get_sparse_checkout();
+        for (const string &file : files)
+        {
+            string key = normalize_path(file);
+            if (!sparse.covers_file(key))
+            {
+                cerr << "Skipped " << file << ", outside the sparse checkout." << endl;
+                continue;
+            }
+            struct stat st;
+            trace_count(counter_stat);
+            if (stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            {
+                // a staged file that was deleted is removed from the index
+                if (errno == ENOENT && index_remove(key))
+                    cout << "Removed " << file << " from staging area." << endl;
+                else
+                    cerr << "Failed to read file: " << file << endl;
+                continue;
+            }
 
+            // unchanged since it was staged, no need to read it again
+            index_entry *staged = index_find(key);
+            if (staged && index_entry_clean(*staged, st))
+            {
+                cout << "Skipped " << file << ", already staged." << endl;
+                continue;
+            }
 
+            // large files are stored as chunks, only the chunks not stored yet are written
+            string sha;
+            if (store_as_chunks(staged, st))
+            {
+                flush_pending();
+                if (store_chunked_file(file, true, sha))
+                    stage(file, key, staged, st, sha, true);
+                else
+                    store_failed = true;
+                continue;
+            }
 
-                //calculating sha value
-                unsigned char hash[SHA_DIGEST_LENGTH];
-                SHA1(reinterpret_cast<const unsigned char *>(content.c_str()), content.size(), hash);
-                ostringstream oss;
-                for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
+            if ((uint64_t)st.st_size < stream_chunk_size)
+            {
+                pending_file f{file, key, staged, st, ""};
+                if (!read_blob_object(file, st, f.object))
                 {
-                    oss << hex << setw(2) << setfill('0') << (int)hash[i];
+                    store_failed = true;
+                    continue;
                 }
-                string sha = oss.str();
+                pending.push_back(move(f));
+                if (pending.size() == add_batch_size)
+                    flush_pending();
+                continue;
+            }
 
-                bool already_staged = false;
+            // the output stays in file order, so earlier small files go first
+            flush_pending();
 
-                // Check if the SHA already exists in the index
-                ifstream index_read(".mygit/index");
-                string line;
-                while (getline(index_read, line))
-                {
-                    if (line.find(sha) != string::npos)
-                    {
-                        already_staged = true;
-                        break;
-                    }
-                }
-                index_read.close();
+            // hash and store the file in one streaming pass
+            if (!hash_file_streaming(file, true, sha))
+            {
+                store_failed = true;
+                continue;
+            }
+            stage(file, key, staged, st, sha);
+        }
+        flush_pending();
 
-                if (!already_staged)
-                {
-                    store_blob(sha, content);
-                    // Update the index file with the file and its SHA
-                    index_file.open(".mygit/index", ios::app);
-                    index_file << sha << " " << file << endl;
-                    index_file.close();
-                    cout << "Added " << file << " to staging area." << endl;
-                }
-                else
+        // "add ." also stages the deletion of files that are gone from the worktree
+        if (add_all)
+        {
+            unordered_set<string> seen;
+            for (const string &file : files)
+                seen.insert(normalize_path(file));
+            auto gone = [&seen, &sparse](const index_entry &e)
+            {
+                return !S_ISDIR(e.mode) && sparse.covers_file(e.path) && !seen.count(e.path);
+            };
+            for (const index_entry &e : index.entries)
+            {
+                if (gone(e))
                 {
-                    cout << "Skipped " << file << ", already staged." << endl;
+                    cache_tree_invalidate(e.path);
+                    cout << "Removed " << e.path << " from staging area." << endl;
                 }
             }
+            index.entries.erase(remove_if(index.entries.begin(), index.entries.end(), gone), index.entries.end());
         }
+
+        // what was stored is staged even when other files failed
+        index_add_entries(added);
+        if (index.dirty && !write_index())
+        {
+            return -1;
+        }
+        if (store_failed)
+            return 1;
     }
     else if (command == "commit")
     {
+        if (!lock_index())
+            return -1;
 
-        string tree_sha = write_tree();
+        // what was staged with add; without an index the worktree is taken as it is
+        string tree_sha = get_index().entries.empty() ? write_tree() : write_index_tree();
+        if (tree_sha.empty())
+        {
+            cerr << "Failed to write tree." << endl;
+            return -1;
+        }
+        if (get_index().dirty && !write_index())
+            return -1;
         string message = "Default commit message";
 
         if (argc == 4 && string(argv[2]) == "-m")
@@ -714,17 +7427,17 @@ int main(int argc, char *argv[])
         string commit_content = oss.str();
 
 
-        //calculating sha value
-        unsigned char hash[SHA_DIGEST_LENGTH];
-        SHA1(reinterpret_cast<const unsigned char *>(commit_content.c_str()), commit_content.size(), hash);
-        ostringstream oss1;
-        for (int i = 0; i < SHA_DIGEST_LENGTH; ++i)
+        // hash and store the commit object
+        string commit_sha = get_object_store().write("commit", commit_content);
+        if (commit_sha.empty())
         {
-            oss1 << hex << setw(2) << setfill('0') << (int)hash[i];
+            cerr << "Failed to write commit." << endl;
+            return -1;
         }
-        string commit_sha = oss1.str();
 
-        store_blob(commit_sha, commit_content);
+        // the objects have to be on disk before HEAD points at them
+        if (!sync_object_writes())
+            return -1;
 
         // updating head file
         ofstream head_file1(".mygit/HEAD");
@@ -734,11 +7447,38 @@ int main(int argc, char *argv[])
             return -1;
         }
         head_file1 << commit_sha;
+        head_file1.close();
+
+        // a failed commit-graph update only costs speed, the commit is already made
+        if (get_config("core.commitGraph", "true") != "false")
+            update_commit_graph(false);
 
         cout << "Commit SHA: " << commit_sha << endl;
     }
     else if (command == "log")
     {
+        // "log -- <path>..." only shows the commits that changed one of the paths
+        vector<string> paths;
+        if (argc > 2)
+        {
+            if (string(argv[2]) != "--" || argc == 3)
+            {
+                cerr << "Usage: ./mygit log [-- <path>...]" << endl;
+                return 1;
+            }
+            for (int i = 3; i < argc; ++i)
+            {
+                string path = normalize_path(argv[i]);
+                while (!path.empty() && path.back() == '/')
+                    path.pop_back();
+                if (path.empty() || path == ".")
+                {
+                    paths.clear();
+                    break;
+                }
+                paths.push_back(path);
+            }
+        }
 
         // getting parent commit object sha value
         ifstream head_file(".mygit/HEAD");
@@ -755,35 +7495,82 @@ int main(int argc, char *argv[])
             return -1;
         }
 
+        // with the commit-graph the next commits are known up front, so they
+        // are inflated in parallel batches before being printed in order
+        commit_graph &graph = get_commit_graph();
+        const size_t prefetch_batch = 256;
+        size_t prefetched = 0;
+        uint32_t pos;
+
         // traverse through all commits and display details
         while (!current_sha.empty())
         {
+            // a commit whose changed-path filter rules out every path is skipped
+            // without reading it; otherwise its tree is compared with its parent's
+            if (!paths.empty())
+            {
+                string tree, parent, parent_tree;
+                if (graph.find(current_sha, pos))
+                {
+                    const unsigned char *filter;
+                    size_t len;
+                    bool maybe = !graph.bloom(pos, filter, len);
+                    for (size_t i = 0; i < paths.size() && !maybe; ++i)
+                        maybe = bloom_maybe_contains(filter, len, paths[i]);
+                    uint32_t parent_pos = graph.parent(pos);
+                    parent = parent_pos == graph_no_parent ? "" : graph.oid(parent_pos);
+                    if (!maybe)
+                    {
+                        current_sha = parent;
+                        continue;
+                    }
+                    tree = graph.tree(pos);
+                    parent_tree = parent_pos == graph_no_parent ? "" : graph.tree(parent_pos);
+                }
+                else
+                {
+                    graph_commit c, p;
+                    if (!parse_commit(current_sha, c))
+                    {
+                        cerr << "Commit not found: " << current_sha << endl;
+                        return -1;
+                    }
+                    tree = c.tree;
+                    parent = c.parent;
+                    if (!parent.empty() && parse_commit(parent, p))
+                        parent_tree = p.tree;
+                }
+                bool changed = false;
+                for (size_t i = 0; i < paths.size() && !changed; ++i)
+                    changed = path_changed(parent_tree, tree, paths[i]);
+                if (!changed)
+                {
+                    current_sha = parent;
+                    continue;
+                }
+            }
+            else if (prefetched == 0 && get_pool() && graph.find(current_sha, pos))
+            {
+                task_group group(get_pool());
+                for (; prefetched < prefetch_batch && pos != graph_no_parent; ++prefetched, pos = graph.parent(pos))
+                {
+                    string sha = graph.oid(pos);
+                    group.run([sha]() { get_object_store().read(sha); });
+                }
+                group.wait();
+            }
+            if (prefetched > 0)
+                --prefetched;
 
             // displaying commit details
-            string dir = ".mygit/objects/" + current_sha.substr(0, 2);
-            string filename = dir + "/" + current_sha.substr(2);
-
-            string compressed_content = read_file(filename);
-            if (compressed_content.empty())
+            shared_ptr<const stored_object> commit = get_object_store().read(current_sha, "commit");
+            if (!commit)
             {
                 cerr << "Commit not found: " << current_sha << endl;
                 return -1;
             }
 
-
-            //decmpressed data
-            uLongf decompressed_size = compressed_content.size() * 4;
-            string decompressed_data(decompressed_size, '\0');
-            while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data[0]), &decompressed_size,
-            reinterpret_cast<const Bytef *>(compressed_content.data()), compressed_content.size()) == Z_BUF_ERROR)
-            {
-                decompressed_size *= 2;
-                decompressed_data.resize(decompressed_size);
-            }
-            decompressed_data.resize(decompressed_size);
-            string content = decompressed_data;
-
-            istringstream iss(content);
+            istringstream iss(commit->content);
             string line, tree_sha, parent_sha, author_info, message;
             bool parent_found = false;
 
@@ -821,85 +7608,134 @@ int main(int argc, char *argv[])
             cout << "Message: " << message << endl;
             cout << "-----------------------------------------" << endl;
 
-            // read the commit object to find the parent SHA value
-            dir = ".mygit/objects/" + current_sha.substr(0, 2);
-            filename = dir + "/" + current_sha.substr(2);
-
-
-            //read content of file
-            ifstream ifs(filename, ios::binary);
-            if (!ifs)
+            // the parent was already found while parsing, no need to read the commit again
+            current_sha = parent_found ? parent_sha : "";
+        }
+    }
+    else if (command == "commit-graph")
+    {
+        if (argc != 3 || string(argv[2]) != "write")
+        {
+            cerr << "Usage: ./mygit commit-graph write" << endl;
+            return 1;
+        }
+        return update_commit_graph(true);
+    }
+    else if (command == "rev-list")
+    {
+        bool count_only = false;
+        string start;
+        for (int i = 2; i < argc; ++i)
+        {
+            if (string(argv[i]) == "--count")
+                count_only = true;
+            else
+                start = argv[i];
+        }
+        if (start.empty())
+        {
+            start = read_file_if_exists(".mygit/HEAD");
+            while (!start.empty() && isspace(static_cast<unsigned char>(start.back())))
+                start.pop_back();
+            if (start.empty())
             {
-                cerr << "Failed to open file: " << filename << endl;
-                return 0;
+                cerr << "No commits found." << endl;
+                return -1;
             }
-            ostringstream oss;
-            oss << ifs.rdbuf();
-            compressed_content = oss.str();
+        }
 
-            //decompress data
-            uLongf decompressed_size1 = compressed_content.size() * 4;
-            string decompressed_data1(decompressed_size1, '\0');
-            while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data1[0]), &decompressed_size1,
-            reinterpret_cast<const Bytef *>(compressed_content.data()), compressed_content.size()) == Z_BUF_ERROR)
+        // walk parent positions in the commit-graph, reading objects only for commits it does not have
+        commit_graph &graph = get_commit_graph();
+        size_t count = 0;
+        string sha = start;
+        uint32_t pos;
+        while (!sha.empty())
+        {
+            if (graph.find(sha, pos))
+            {
+                for (; pos != graph_no_parent; pos = graph.parent(pos), ++count)
+                {
+                    if (!count_only)
+                        cout << graph.oid(pos) << "\n";
+                }
+                break;
+            }
+            string parent;
+            if (!read_commit_parent(sha, parent))
             {
-                decompressed_size1 *= 2;
-                decompressed_data1.resize(decompressed_size);
+                cerr << "Commit not found: " << sha << endl;
+                return -1;
             }
-            decompressed_data1.resize(decompressed_size1);
-            content = decompressed_data1;
-
-
-            istringstream iss1(content);
-            string line1;
+            if (!count_only)
+                cout << sha << "\n";
+            ++count;
+            sha = parent;
+        }
+        if (count_only)
+            cout << count << endl;
+    }
+    else if (command == "merge-base")
+    {
+        if (argc != 5 || string(argv[2]) != "--is-ancestor")
+        {
+            cerr << "Usage: ./mygit merge-base --is-ancestor <commit> <commit>" << endl;
+            return 1;
+        }
+        string ancestor = argv[3];
+        string sha = argv[4];
 
-            // reset for the next parent lookup
-            current_sha.clear();
-            while (getline(iss1, line1))
+        // exit status 0 if ancestor is reachable from the second commit, 1 if not
+        commit_graph &graph = get_commit_graph();
+        uint32_t ancestor_pos, pos;
+        while (!sha.empty())
+        {
+            if (sha == ancestor)
+                return 0;
+            if (graph.find(sha, pos) && graph.find(ancestor, ancestor_pos))
             {
-                if (starts_with(line1, "parent "))
-                {
-                    // update with the parent SHA value
-                    current_sha = line1.substr(7);
-                    break;
-                }
+                // generation numbers only go down along parents, so the walk stops
+                // as soon as it is at or below the ancestor's generation
+                uint32_t generation = graph.generation(ancestor_pos);
+                while (pos != graph_no_parent && graph.generation(pos) > generation)
+                    pos = graph.parent(pos);
+                return pos == ancestor_pos ? 0 : 1;
             }
+            string parent;
+            if (!read_commit_parent(sha, parent))
+            {
+                cerr << "Commit not found: " << sha << endl;
+                return -1;
+            }
+            sha = parent;
         }
+        return 1;
     }
     else if (command == "checkout")
     {
-        if (argc < 3)
+        if (argc < 3 || (argc > 3 && string(argv[3]) != "--"))
         {
-            cerr << "Usage: ./mygit checkout <commit_sha>" << endl;
+            cerr << "Usage: ./mygit checkout <commit_sha> [-- <dir>...]" << endl;
             return -1;
         }
+        if (!lock_index())
+            return -1;
 
         string commit_sha = argv[2];
-        string dir = ".mygit/objects/" + commit_sha.substr(0, 2);
-        string filename = dir + "/" + commit_sha.substr(2);
 
-        string compressed_content = read_file(filename);
-        if (compressed_content.empty())
+        // "-- <dir>..." sets the sparse checkout ("--" alone or "-- ." clears it),
+        // otherwise the current one is kept
+        const sparse_checkout &before = get_sparse_checkout();
+        sparse_checkout after = before;
+        if (argc > 3)
+            after = make_sparse_checkout(vector<string>(argv + 4, argv + argc));
+        shared_ptr<const stored_object> commit = get_object_store().read(commit_sha, "commit");
+        if (!commit)
         {
             cerr << "Commit not found: " << commit_sha << endl;
             return -1;
         }
 
-
-
-        //decompress data
-        uLongf decompressed_size = compressed_content.size() * 4;
-        string decompressed_data(decompressed_size, '\0');
-        while (uncompress(reinterpret_cast<Bytef *>(&decompressed_data[0]), &decompressed_size,
-        reinterpret_cast<const Bytef *>(compressed_content.data()), compressed_content.size()) == Z_BUF_ERROR)
-        {
-            decompressed_size *= 2;
-            decompressed_data.resize(decompressed_size);
-        }
-        decompressed_data.resize(decompressed_size);
-        string content = decompressed_data;
-
-        istringstream iss(content);
+        istringstream iss(commit->content);
         string line, tree_sha;
 
         // Extract the tree SHA from the commit object
@@ -918,16 +7754,56 @@ int main(int argc, char *argv[])
             return -1;
         }
 
-        // clear the current working directory (except .mygit directory)
-        for (const auto &entry : filesystem::directory_iterator("."))
+        // the tree of the current HEAD, from the commit-graph when it has the commit
+        string head_sha = read_file_if_exists(".mygit/HEAD");
+        while (!head_sha.empty() && isspace(static_cast<unsigned char>(head_sha.back())))
+            head_sha.pop_back();
+        string head_tree;
+        commit_graph &graph = get_commit_graph();
+        uint32_t pos;
+        if (graph.find(head_sha, pos))
+            head_tree = graph.tree(pos);
+        else
         {
-            if (entry.path().filename() == ".mygit")
-                continue;
-            filesystem::remove_all(entry.path());
+            graph_commit head;
+            if (!head_sha.empty() && parse_commit(head_sha, head))
+                head_tree = head.tree;
+        }
+
+        // a file that could not be written would get the new SHA with the old
+        // file's stat data in the index, so the index and HEAD stay as they are
+        bool ok;
+        unordered_set<string> written;
+        if (!head_tree.empty())
+        {
+            // only write what differs between the two trees
+            ok = checkout_tree(head_tree, tree_sha, written, ".", before, after);
+        }
+        else
+        {
+            // clear the current working directory (except .mygit directory)
+            for (const auto &entry : filesystem::directory_iterator("."))
+            {
+                if (entry.path().filename() == ".mygit")
+                    continue;
+                filesystem::remove_all(entry.path());
+            }
+
+            // restore the tree and files from the tree object
+            ok = restore_tree(tree_sha, written, ".", after);
+        }
+        if (!ok)
+        {
+            cerr << "Failed to check out commit: " << commit_sha << endl;
+            return -1;
         }
 
-        // restore the tree and files from the tree object
-        restore_tree(tree_sha);
+        // the index (and its cache-tree) now describes the checked out tree
+        reset_index(tree_sha, written, after);
+        if (!write_index())
+            return -1;
+        if (after.dirs != before.dirs && !write_sparse_checkout(after))
+            return -1;
 
         // update HEAD to the checked-out commit
         ofstream head_file(".mygit/HEAD");
@@ -940,5 +7816,44 @@ int main(int argc, char *argv[])
 
         cout << "Checked out to commit: " << commit_sha << endl;
     }
+    else if (command == "repack")
+    {
+        return repack();
+    }
+    else if (command == "gc")
+    {
+        return gc_command(argc, argv);
+    }
+    else if (command == "clone")
+    {
+        return clone_command(argc, argv);
+    }
+    else if (command == "fetch")
+    {
+        return fetch_command(argc, argv);
+    }
+    else if (command == "upload-pack")
+    {
+        return upload_pack();
+    }
+    else if (command == "diff")
+    {
+        return diff_command(argc, argv);
+    }
+    else if (command == "fsmonitor")
+    {
+        return fsmonitor_command(argc > 2 ? argv[2] : "");
+    }
+    else if (command == "bench-hash")
+    {
+        size_t count = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000;
+        size_t size = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1024;
+        if (count == 0)
+        {
+            cerr << "Usage: ./mygit bench-hash [<count>] [<size>]" << endl;
+            return 1;
+        }
+        return bench_hash(count, size);
+    }
     return 0;
 }